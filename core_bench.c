@@ -0,0 +1,144 @@
+#include "message_slot_core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Microbenchmark of the module's data structures, built in userspace from
+ * message_slot_core.h (no root or module needed): for slots of 1e3 up to
+ * max channels (1e5 by default; 1e7 takes about 4.6 GB), times inserting
+ * every channel into the index, then looking up and overwriting channels
+ * picked at random, as the write path does.
+ * Channel IDs are either dense (1..n) or sparse (spread over 32 bits), which
+ * is what decides the shape of the index.
+ * Prints one line per slot size, ID layout and operation, in mean ns per op.
+ * Usage: ./core_bench [max channels] [operations]
+ */
+
+#define DEFAULT_MAX_CHANNELS 100000
+#define DEFAULT_OPERATIONS 1000000
+#define MIN_CHANNELS 1000
+#define MESSAGE_SIZE 16
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// xorshift64, so picking a channel costs next to nothing
+static unsigned long long next_random(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Multiplying by an odd constant is a bijection on 32 bits, so the sparse
+// IDs are distinct and, since i + 1 < 2^32, never 0.
+static unsigned int channel_id(long i, int sparse) {
+    return sparse ? (unsigned int) ((i + 1) * 2654435761UL) : (unsigned int) (i + 1);
+}
+
+static void report(const char *layout, long channels, const char *op, long long elapsed, long operations) {
+    printf("%-6s %8ld channels: %-9s %8.1f ns/op\n", layout, channels, op, (double) elapsed / operations);
+}
+
+static int bench_insert(struct xarray *index, struct Channel *channels, long n, int sparse) {
+    long long start = now_ns();
+    for (long i = 0; i < n; i++) {
+        initialize_channel(&channels[i], NULL, channel_id(i, sparse));
+        if (index_channel(index, &channels[i], GFP_KERNEL) != SUCCESS) {
+            fprintf(stderr, "bench_insert: index_channel failed for channel %u\n", channel_id(i, sparse));
+            return -1;
+        }
+    }
+    report(sparse ? "sparse" : "dense", n, "insert", now_ns() - start, n);
+    return 0;
+}
+
+static int bench_lookup(struct xarray *index, long n, int sparse, long operations) {
+    unsigned long long state = 88172645463325252ULL;
+    struct Channel *channel;
+    long long start = now_ns();
+    for (long i = 0; i < operations; i++) {
+        channel = lookup_channel(index, channel_id(next_random(&state) % n, sparse));
+        if (channel == NULL) {
+            fprintf(stderr, "bench_lookup: channel not found\n");
+            return -1;
+        }
+        refcount_dec_and_test(&channel->refs);
+    }
+    report(sparse ? "sparse" : "dense", n, "lookup", now_ns() - start, operations);
+    return 0;
+}
+
+// The overwrite-mode part of store_message(), on a channel looked up as write() does
+static int bench_overwrite(struct xarray *index, long n, int sparse, long operations) {
+    unsigned long long state = 88172645463325252ULL;
+    char message[MESSAGE_SIZE];
+    struct Channel *channel;
+    long long start;
+    memset(message, 'm', sizeof(message));
+    start = now_ns();
+    for (long i = 0; i < operations; i++) {
+        channel = lookup_channel(index, channel_id(next_random(&state) % n, sparse));
+        if (channel == NULL) {
+            fprintf(stderr, "bench_overwrite: channel not found\n");
+            return -1;
+        }
+        mutex_lock(&channel->lock);
+        replace_message(channel, message, sizeof(message), NULL);
+        channel->version++;
+        mutex_unlock(&channel->lock);
+        refcount_dec_and_test(&channel->refs);
+    }
+    report(sparse ? "sparse" : "dense", n, "overwrite", now_ns() - start, operations);
+    return 0;
+}
+
+static int bench_slot(long n, int sparse, long operations) {
+    struct xarray index;
+    struct Channel *channels = malloc(sizeof(struct Channel) * n);
+    int result;
+    if (channels == NULL) {
+        fprintf(stderr, "bench_slot: can't allocate %ld channels\n", n);
+        return -1;
+    }
+    xa_init(&index);
+    result = bench_insert(&index, channels, n, sparse);
+    if (result == 0) {
+        result = bench_lookup(&index, n, sparse, operations);
+    }
+    if (result == 0) {
+        result = bench_overwrite(&index, n, sparse, operations);
+    }
+    xa_destroy(&index);
+    free(channels);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    long max_channels = DEFAULT_MAX_CHANNELS;
+    long operations = DEFAULT_OPERATIONS;
+    if (argc > 1) {
+        max_channels = atol(argv[1]);
+    }
+    if (argc > 2) {
+        operations = atol(argv[2]);
+    }
+    if (max_channels < MIN_CHANNELS || operations < 1) {
+        fprintf(stderr, "Usage: %s [max channels, at least %d] [operations]\n", argv[0], MIN_CHANNELS);
+        return -1;
+    }
+    printf("sizeof(struct Channel) = %zu bytes\n", sizeof(struct Channel));
+    for (long n = MIN_CHANNELS; n <= max_channels; n *= 10) {
+        for (int sparse = 0; sparse <= 1; sparse++) {
+            if (bench_slot(n, sparse, operations) != 0) {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return 0;
+}
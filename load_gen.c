@@ -0,0 +1,452 @@
+#include "message_slot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h> /* open */
+#include <sys/ioctl.h>  /* ioctl */
+#include <unistd.h> /* read, write, pread, pwrite */
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+
+/*
+ * Multi-threaded load generator. Spreads reader, writer and mixed threads
+ * over every given device file (one per minor) and its channels, picked
+ * uniformly or by a Zipfian popularity, for a fixed duration. Every channel
+ * is written once before the clock starts, so reads only come back empty if
+ * the module lost a message, and has its size limit raised to the largest
+ * payload if that is longer than BUF_LEN.
+ * Prints one JSON object with the configuration and, for reads and writes,
+ * ops/s and p50/p99/p99.9/max latency in ns, so runs against two module
+ * builds can be compared by a script.
+ * Usage: ./load_gen [options] <device file>...
+ */
+
+#define DEFAULT_CHANNELS 1024
+#define DEFAULT_DURATION 10
+#define DEFAULT_SIZE 16
+#define DEFAULT_ZIPF_S 0.99
+// Latency histogram: values under 2^SUB_BITS ns get a bucket each, larger
+// ones 2^SUB_BITS buckets per power of two, which is within 6% of the value.
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define LATENCY_BUCKETS (64 * SUB_BUCKETS)
+
+enum op {
+    OP_READ,
+    OP_WRITE,
+    NR_OPS,
+};
+
+enum thread_kind {
+    READER,
+    WRITER,
+    MIXED,
+};
+
+struct op_stats {
+    unsigned long ops;
+    unsigned long bytes;
+    unsigned long empty; /* EWOULDBLOCK: read of a channel holding no message */
+    unsigned long errors;
+    unsigned long long max_ns;
+    unsigned long latency[LATENCY_BUCKETS];
+};
+
+struct worker {
+    pthread_t thread;
+    enum thread_kind kind;
+    int *fds; /* one per device file */
+    unsigned long long random_state;
+    char *bffr;
+    struct op_stats stats[NR_OPS];
+};
+
+struct config {
+    char **device_files;
+    int minors;
+    int readers;
+    int writers;
+    int mixed;
+    unsigned int read_share; /* of mixed threads' operations, read_share : write_share */
+    unsigned int write_share;
+    unsigned int channels; /* per minor */
+    int zipf;
+    double zipf_s;
+    int min_size;
+    int max_size;
+    int duration;
+    int use_ioctl;
+    const char *label;
+};
+
+static struct config config = {
+    .readers = 1,
+    .writers = 1,
+    .read_share = 1,
+    .write_share = 1,
+    .channels = DEFAULT_CHANNELS,
+    .zipf_s = DEFAULT_ZIPF_S,
+    .min_size = DEFAULT_SIZE,
+    .max_size = DEFAULT_SIZE,
+    .duration = DEFAULT_DURATION,
+    .label = "",
+};
+/* Zipfian CDF over channel ranks, rank r being channel r / minors + 1 of minor r % minors */
+static double *popularity;
+static volatile int stop;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long next_random(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static int latency_bucket(unsigned long long ns) {
+    int msb;
+    if (ns < SUB_BUCKETS) {
+        return (int) ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS + (int) ((ns >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* the largest value counted in bucket */
+static unsigned long long bucket_limit(int bucket) {
+    int msb;
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    msb = bucket / SUB_BUCKETS + SUB_BITS - 1;
+    return ((unsigned long long) (SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << (msb - SUB_BITS)) - 1;
+}
+
+static int build_popularity(void) {
+    unsigned long ranks = (unsigned long) config.channels * config.minors;
+    double total = 0;
+    popularity = malloc(sizeof(double) * ranks);
+    if (popularity == NULL) {
+        fprintf(stderr, "build_popularity: can't allocate %lu ranks\n", ranks);
+        return -1;
+    }
+    for (unsigned long r = 0; r < ranks; r++) {
+        total += 1.0 / pow(r + 1, config.zipf_s);
+        popularity[r] = total;
+    }
+    for (unsigned long r = 0; r < ranks; r++) {
+        popularity[r] /= total;
+    }
+    return 0;
+}
+
+static unsigned long pick_rank(struct worker *worker) {
+    unsigned long ranks = (unsigned long) config.channels * config.minors;
+    unsigned long low = 0, high = ranks - 1, middle;
+    double u;
+    if (!config.zipf) {
+        return next_random(&worker->random_state) % ranks;
+    }
+    u = (next_random(&worker->random_state) >> 11) * 0x1.0p-53;
+    while (low < high) {
+        middle = (low + high) / 2;
+        if (popularity[middle] < u) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static int pick_size(struct worker *worker) {
+    return config.min_size + (int) (next_random(&worker->random_state) % (config.max_size - config.min_size + 1));
+}
+
+/* Returns what read() or write() did, or -1 with errno set */
+static ssize_t run_op(struct worker *worker, enum op op, int fd, unsigned int channel, int size) {
+    if (config.use_ioctl) {
+        if (ioctl(fd, MSG_SLOT_CHANNEL, channel) == -1) {
+            return -1;
+        }
+        return op == OP_READ ? read(fd, worker->bffr, config.max_size) : write(fd, worker->bffr, size);
+    }
+    return op == OP_READ ? pread(fd, worker->bffr, config.max_size, channel) : pwrite(fd, worker->bffr, size, channel);
+}
+
+static void record_op(struct op_stats *stats, ssize_t result, unsigned long long ns) {
+    stats->ops++;
+    if (result >= 0) {
+        stats->bytes += result;
+    } else if (errno == EWOULDBLOCK) {
+        stats->empty++;
+    } else {
+        stats->errors++;
+    }
+    stats->latency[latency_bucket(ns)]++;
+    if (ns > stats->max_ns) {
+        stats->max_ns = ns;
+    }
+}
+
+static enum op pick_op(struct worker *worker) {
+    if (worker->kind != MIXED) {
+        return worker->kind == READER ? OP_READ : OP_WRITE;
+    }
+    return next_random(&worker->random_state) % (config.read_share + config.write_share) < config.read_share ? OP_READ : OP_WRITE;
+}
+
+static void *run_worker(void *arg) {
+    struct worker *worker = arg;
+    unsigned long rank;
+    enum op op;
+    int size = 0;
+    long long start;
+    ssize_t result;
+    while (!stop) {
+        op = pick_op(worker);
+        rank = pick_rank(worker);
+        if (op == OP_WRITE) {
+            size = pick_size(worker);
+        }
+        start = now_ns();
+        result = run_op(worker, op, worker->fds[rank % config.minors], rank / config.minors + 1, size);
+        record_op(&worker->stats[op], result, now_ns() - start);
+    }
+    return NULL;
+}
+
+static int open_device_files(int *fds) {
+    for (int i = 0; i < config.minors; i++) {
+        fds[i] = open(config.device_files[i], O_RDWR); /* created beforehand */
+        if (fds[i] < 0) {
+            fprintf(stderr, "Can't open device file: %s\n", config.device_files[i]);
+            return -1;
+        }
+        if (!config.use_ioctl && ioctl(fds[i], MSG_SLOT_OFFSET_ADDRESSING, 1) == -1) {
+            fprintf(stderr, "open_device_files: ioctl failed with error: %d\n", errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Channels only take messages longer than BUF_LEN once their limit is raised */
+static int raise_size_limit(int fd, unsigned int channel) {
+    if (ioctl(fd, MSG_SLOT_CHANNEL, channel) == -1 || ioctl(fd, MSG_SLOT_MAX_MESSAGE_SIZE, config.max_size) == -1) {
+        fprintf(stderr, "prefill: raising the size limit of channel %u failed with error: %d\n", channel, errno);
+        return -1;
+    }
+    return 0;
+}
+
+static int prefill(struct worker *worker) {
+    for (unsigned long rank = 0; rank < (unsigned long) config.channels * config.minors; rank++) {
+        if (config.max_size > BUF_LEN && raise_size_limit(worker->fds[rank % config.minors], rank / config.minors + 1) != 0) {
+            return -1;
+        }
+        if (run_op(worker, OP_WRITE, worker->fds[rank % config.minors], rank / config.minors + 1, config.min_size) < 0) {
+            fprintf(stderr, "prefill: write failed with error: %d\n", errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static unsigned long long percentile(struct op_stats *stats, double p) {
+    unsigned long target = (unsigned long) ceil(p * stats->ops), seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += stats->latency[b];
+        if (seen >= target && seen > 0) {
+            return bucket_limit(b) < stats->max_ns ? bucket_limit(b) : stats->max_ns;
+        }
+    }
+    return 0;
+}
+
+static void print_op(const char *name, struct op_stats *stats, double seconds) {
+    printf("\"%s\":{\"ops\":%lu,\"ops_per_sec\":%.1f,\"bytes\":%lu,\"empty\":%lu,\"errors\":%lu,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+           name, stats->ops, stats->ops / seconds, stats->bytes, stats->empty, stats->errors,
+           percentile(stats, 0.5), percentile(stats, 0.99), percentile(stats, 0.999), stats->max_ns);
+}
+
+static void print_results(struct op_stats *totals, double seconds) {
+    printf("{\"label\":\"%s\",\"minors\":%d,\"channels\":%u,\"readers\":%d,\"writers\":%d,\"mixed\":%d,"
+           "\"mix\":\"%u:%u\",\"distribution\":\"%s\",\"zipf_s\":%.3f,\"min_size\":%d,\"max_size\":%d,"
+           "\"addressing\":\"%s\",\"seconds\":%.3f,",
+           config.label, config.minors, config.channels, config.readers, config.writers, config.mixed,
+           config.read_share, config.write_share, config.zipf ? "zipf" : "uniform", config.zipf_s,
+           config.min_size, config.max_size, config.use_ioctl ? "ioctl" : "offset", seconds);
+    print_op("read", &totals[OP_READ], seconds);
+    printf(",");
+    print_op("write", &totals[OP_WRITE], seconds);
+    printf("}\n");
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options] <device file>...\n"
+            "  -r, --readers N      threads that only read (default 1)\n"
+            "  -w, --writers M      threads that only write (default 1)\n"
+            "  -t, --mixed T        threads that read and write (default 0)\n"
+            "  -m, --mix R:W        read:write ratio of mixed threads (default 1:1)\n"
+            "  -c, --channels C     channels per device file (default %d)\n"
+            "  -z, --zipf [S]       Zipfian channel popularity with exponent S (default %.2f)\n"
+            "                       instead of uniform\n"
+            "  -s, --size MIN[:MAX] payload size in bytes (default %d)\n"
+            "  -d, --duration SEC   (default %d)\n"
+            "  -i, --ioctl          set the channel with ioctl before each read/write\n"
+            "                       instead of using pread/pwrite offsets\n"
+            "  -l, --label TEXT     copied into the output, e.g. the module version\n",
+            program, DEFAULT_CHANNELS, DEFAULT_ZIPF_S, DEFAULT_SIZE, DEFAULT_DURATION);
+}
+
+static int parse_arguments(int argc, char *argv[]) {
+    static const struct option options[] = {
+        {"readers", required_argument, NULL, 'r'},
+        {"writers", required_argument, NULL, 'w'},
+        {"mixed", required_argument, NULL, 't'},
+        {"mix", required_argument, NULL, 'm'},
+        {"channels", required_argument, NULL, 'c'},
+        {"zipf", optional_argument, NULL, 'z'},
+        {"size", required_argument, NULL, 's'},
+        {"duration", required_argument, NULL, 'd'},
+        {"ioctl", no_argument, NULL, 'i'},
+        {"label", required_argument, NULL, 'l'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "r:w:t:m:c:z::s:d:il:", options, NULL)) != -1) {
+        switch (option) {
+            case 'r':
+                config.readers = atoi(optarg);
+                break;
+            case 'w':
+                config.writers = atoi(optarg);
+                break;
+            case 't':
+                config.mixed = atoi(optarg);
+                break;
+            case 'm':
+                if (sscanf(optarg, "%u:%u", &config.read_share, &config.write_share) != 2) {
+                    return -1;
+                }
+                break;
+            case 'c':
+                config.channels = (unsigned int) atol(optarg);
+                break;
+            case 'z':
+                config.zipf = 1;
+                if (optarg != NULL) {
+                    config.zipf_s = atof(optarg);
+                }
+                break;
+            case 's':
+                if (sscanf(optarg, "%d:%d", &config.min_size, &config.max_size) == 1) {
+                    config.max_size = config.min_size;
+                }
+                break;
+            case 'd':
+                config.duration = atoi(optarg);
+                break;
+            case 'i':
+                config.use_ioctl = 1;
+                break;
+            case 'l':
+                config.label = optarg;
+                break;
+            default:
+                return -1;
+        }
+    }
+    config.device_files = &argv[optind];
+    config.minors = argc - optind;
+    if (config.minors < 1 || config.readers < 0 || config.writers < 0 || config.mixed < 0 ||
+        config.readers + config.writers + config.mixed < 1 || config.read_share + config.write_share == 0 ||
+        config.channels < 1 || config.min_size < 1 || config.max_size < config.min_size ||
+        config.max_size > MAX_MESSAGE_SIZE || config.duration < 1) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int threads, created = 0, status = 0;
+    struct worker *workers;
+    struct op_stats totals[NR_OPS];
+    long long start, end;
+    if (parse_arguments(argc, argv) != 0) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (config.zipf && build_popularity() != 0) {
+        return -1;
+    }
+    threads = config.readers + config.writers + config.mixed;
+    workers = calloc(threads, sizeof(struct worker));
+    for (int i = 0; i < threads; i++) {
+        workers[i].kind = i < config.readers ? READER : i < config.readers + config.writers ? WRITER : MIXED;
+        workers[i].fds = malloc(sizeof(int) * config.minors);
+        workers[i].bffr = malloc(config.max_size);
+        workers[i].random_state = 0x9E3779B97F4A7C15ULL * (i + 1) ^ (unsigned long long) now_ns();
+        memset(workers[i].bffr, 'm', config.max_size);
+        if (open_device_files(workers[i].fds) != 0) {
+            return -1;
+        }
+    }
+    if (prefill(&workers[0]) != 0) {
+        return -1;
+    }
+    start = now_ns();
+    for (; created < threads; created++) {
+        if (pthread_create(&workers[created].thread, NULL, run_worker, &workers[created]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            stop = 1;
+            status = -1;
+            break;
+        }
+    }
+    if (status == 0) {
+        sleep(config.duration);
+        stop = 1;
+    }
+    end = now_ns();
+    memset(totals, 0, sizeof(totals));
+    for (int i = 0; i < created; i++) {
+        pthread_join(workers[i].thread, NULL);
+        for (int op = 0; op < NR_OPS; op++) {
+            totals[op].ops += workers[i].stats[op].ops;
+            totals[op].bytes += workers[i].stats[op].bytes;
+            totals[op].empty += workers[i].stats[op].empty;
+            totals[op].errors += workers[i].stats[op].errors;
+            if (workers[i].stats[op].max_ns > totals[op].max_ns) {
+                totals[op].max_ns = workers[i].stats[op].max_ns;
+            }
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                totals[op].latency[b] += workers[i].stats[op].latency[b];
+            }
+        }
+    }
+    if (status == 0) {
+        print_results(totals, (end - start) / 1e9);
+    }
+    for (int i = 0; i < threads; i++) {
+        for (int fd = 0; fd < config.minors; fd++) {
+            close(workers[i].fds[fd]);
+        }
+        free(workers[i].fds);
+        free(workers[i].bffr);
+    }
+    free(workers);
+    free(popularity);
+    return status;
+}
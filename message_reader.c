@@ -1,35 +1,104 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <time.h>
 
 #include "message_slot.h"
 
-static void check_arguments(int argc);
+/*
+    Usage: message_reader <file> <channel>
+       or: message_reader <file> --stream [--binary] [channel...]
+       or: message_reader <file> --follow [--timestamp] <channel>...
+    In stream mode the message of every channel listed (or, if none are,
+    of every channel ID read from stdin) is printed to stdout in the format
+    message_sender --stream takes: lines of "<channel> <message>" or, with
+    --binary, struct msg_slot_record headers each followed by its message.
+    A message containing a newline can't be a line, so in text mode it is
+    reported on stderr and skipped.
+    Channels are read over the one open file in batches of STREAM_BATCH with
+    MSG_SLOT_BATCH_READ; those holding no message are skipped.
+    In follow mode the channels are watched like tail -f: their current
+    message and every later one are printed once each (a message overwritten
+    before it could be read is never seen, as with any reader), as the
+    message alone when following one channel and as "<channel> <message>"
+    otherwise, prefixed with the UTC time it was read at if --timestamp is
+    given. Each channel gets its own file, so poll() reports it readable
+    exactly when it holds a message that file hasn't read yet. A channel
+    that fails (e.g. is deleted) is reported on stderr and dropped.
+*/
+
+#define STREAM_OPTION "--stream"
+#define BINARY_OPTION "--binary"
+#define FOLLOW_OPTION "--follow"
+#define TIMESTAMP_OPTION "--timestamp"
+#define STREAM_BATCH 256
+
+struct Stream
+{
+    struct msg_slot_batch_entry entries[STREAM_BATCH];
+    char buffers[STREAM_BATCH][BUF_LEN];
+    unsigned int count;
+    char *large_buffer; // for messages longer than BUF_LEN, allocated on first use
+    int binary;
+    int failed;
+};
+
+static void check_arguments(int argc, char *argv[]);
+static int is_stream_mode(int argc, char *argv[]);
+static int is_follow_mode(int argc, char *argv[]);
 static int open_file_for_read(char *path);
 static int set_channel_and_read_message(int fd, unsigned int command_id, int channel_id, char *buffer);
 static void set_channel(int fd, unsigned int command_id, int channel_id);
 static int read_message(int fd, char *buffer);
 static void print_message(char *buffer, int length);
+static int stream_messages(int fd, int binary, int channel_count, char *channels[]);
+static void add_channel(struct Stream *stream, const char *channel, int fd);
+static void flush_channels(struct Stream *stream, int fd);
+static void print_large_message(struct Stream *stream, unsigned int channel_id, int fd);
+static void print_record(struct Stream *stream, unsigned int channel_id, const char *message, int length);
+static int follow_channels(int fd, char *path, int timestamps, int channel_count, char *channels[]);
+static int read_update(int fd, char *buffer);
+static void print_update(const char *channel, int show_channel, int timestamps, const char *message, int length);
+static void print_timestamp(void);
 static void error_and_exit(void);
 
 int main(int argc, char *argv[])
 {
-    check_arguments(argc);
+    check_arguments(argc, argv);
     int fd = open_file_for_read(argv[1]);
     char buffer[BUF_LEN];
-    int bytes_read = set_channel_and_read_message(fd, MSG_SLOT_CHANNEL, atoi(argv[2]), buffer);
-    print_message(buffer, bytes_read);
+    int bytes_read;
+    int status = SUCCESS;
+    int binary;
+    int timestamps;
+    if (is_follow_mode(argc, argv))
+    {
+        timestamps = strcmp(argv[3], TIMESTAMP_OPTION) == 0;
+        status = follow_channels(fd, argv[1], timestamps, argc - 3 - timestamps, &argv[3 + timestamps]);
+    }
+    else if (is_stream_mode(argc, argv))
+    {
+        binary = argc > 3 && strcmp(argv[3], BINARY_OPTION) == 0;
+        status = stream_messages(fd, binary, argc - 3 - binary, &argv[3 + binary]);
+    }
+    else
+    {
+        bytes_read = set_channel_and_read_message(fd, MSG_SLOT_CHANNEL, atoi(argv[2]), buffer);
+        print_message(buffer, bytes_read);
+    }
     close(fd);
-    return 0;
+    return status;
 }
 
-static void check_arguments(int argc)
+static void check_arguments(int argc, char *argv[])
 {
-    if (argc != 3)
+    if (argc != 3 && !is_stream_mode(argc, argv) && !is_follow_mode(argc, argv))
     {
         errno = EINVAL;
         perror("Incorrect number of arguments for message_reader.c");
@@ -37,6 +106,17 @@ static void check_arguments(int argc)
     }
 }
 
+static int is_stream_mode(int argc, char *argv[])
+{
+    return argc >= 3 && strcmp(argv[2], STREAM_OPTION) == 0;
+}
+
+static int is_follow_mode(int argc, char *argv[])
+{
+    return argc >= 4 && strcmp(argv[2], FOLLOW_OPTION) == 0 &&
+           (strcmp(argv[3], TIMESTAMP_OPTION) != 0 || argc >= 5);
+}
+
 static int open_file_for_read(char *path)
 {
     int fd = open(path, O_RDONLY);
@@ -81,8 +161,230 @@ static void print_message(char *buffer, int length)
     }
 }
 
+// Returns SUCCESS, or EXIT_FAILURE if any channel ID was malformed or failed.
+static int stream_messages(int fd, int binary, int channel_count, char *channels[])
+{
+    static struct Stream stream;
+    char channel[32];
+    int i;
+    stream.binary = binary;
+    for (i = 0; i < channel_count; i++)
+    {
+        add_channel(&stream, channels[i], fd);
+    }
+    while (channel_count == 0 && scanf("%31s", channel) == 1)
+    {
+        add_channel(&stream, channel, fd);
+    }
+    flush_channels(&stream, fd);
+    if (fflush(stdout) != 0)
+    {
+        error_and_exit();
+    }
+    free(stream.large_buffer);
+    return stream.failed ? EXIT_FAILURE : SUCCESS;
+}
+
+static void add_channel(struct Stream *stream, const char *channel, int fd)
+{
+    char *end;
+    unsigned long channel_id;
+    errno = 0;
+    channel_id = strtoul(channel, &end, 10);
+    if (end == channel || *end != '\0' || errno != 0 || channel_id > UINT32_MAX)
+    {
+        fprintf(stderr, "message_reader: invalid channel \"%s\"\n", channel);
+        stream->failed = 1;
+        return;
+    }
+    if (stream->count == STREAM_BATCH)
+    {
+        flush_channels(stream, fd);
+    }
+    stream->entries[stream->count].channel_id = channel_id;
+    stream->entries[stream->count].length = BUF_LEN;
+    stream->entries[stream->count].buffer = (uintptr_t)stream->buffers[stream->count];
+    stream->count++;
+}
+
+static void flush_channels(struct Stream *stream, int fd)
+{
+    struct msg_slot_batch batch = {(uintptr_t)stream->entries, stream->count, 0};
+    struct msg_slot_batch_entry *entry;
+    unsigned int i;
+    if (stream->count == 0)
+    {
+        return;
+    }
+    if (ioctl(fd, MSG_SLOT_BATCH_READ, &batch) < 0)
+    {
+        error_and_exit();
+    }
+    for (i = 0; i < stream->count; i++)
+    {
+        entry = &stream->entries[i];
+        if (entry->result >= 0)
+        {
+            print_record(stream, entry->channel_id, stream->buffers[i], entry->result);
+        }
+        else if (entry->result == -ENOSPC)
+        {
+            print_large_message(stream, entry->channel_id, fd);
+        }
+        else if (entry->result != -EWOULDBLOCK)
+        {
+            fprintf(stderr, "message_reader: channel %u: %s\n", entry->channel_id, strerror(-entry->result));
+            stream->failed = 1;
+        }
+    }
+    stream->count = 0;
+}
+
+// Batch entries only have room for BUF_LEN bytes, so longer messages are read on their own.
+static void print_large_message(struct Stream *stream, unsigned int channel_id, int fd)
+{
+    int bytes_read;
+    if (stream->large_buffer == NULL && (stream->large_buffer = malloc(MAX_MESSAGE_SIZE)) == NULL)
+    {
+        error_and_exit();
+    }
+    set_channel(fd, MSG_SLOT_CHANNEL, channel_id);
+    bytes_read = read(fd, stream->large_buffer, MAX_MESSAGE_SIZE);
+    if (bytes_read >= 0)
+    {
+        print_record(stream, channel_id, stream->large_buffer, bytes_read);
+    }
+    else if (errno != EWOULDBLOCK)
+    {
+        fprintf(stderr, "message_reader: channel %u: %s\n", channel_id, strerror(errno));
+        stream->failed = 1;
+    }
+}
+
+// A text record ends at the first newline, so a message holding one can't
+// be printed as one; it is reported instead, as message_sender would fail
+// to read it back.
+static void print_record(struct Stream *stream, unsigned int channel_id, const char *message, int length)
+{
+    struct msg_slot_record record = {channel_id, length};
+    int printed;
+    if (!stream->binary && memchr(message, '\n', length) != NULL)
+    {
+        fprintf(stderr, "message_reader: channel %u: message contains a newline, use %s\n", channel_id, BINARY_OPTION);
+        stream->failed = 1;
+        return;
+    }
+    if (stream->binary)
+    {
+        printed = fwrite(&record, sizeof(record), 1, stdout) == 1 && fwrite(message, 1, length, stdout) == (size_t)length;
+    }
+    else
+    {
+        printed = printf("%u ", channel_id) > 0 && fwrite(message, 1, length, stdout) == (size_t)length && putchar('\n') != EOF;
+    }
+    if (!printed)
+    {
+        error_and_exit();
+    }
+}
+
+// Only returns, with EXIT_FAILURE, once every channel has failed.
+static int follow_channels(int fd, char *path, int timestamps, int channel_count, char *channels[])
+{
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * channel_count);
+    char *buffer = malloc(MAX_MESSAGE_SIZE);
+    int remaining = channel_count;
+    int bytes_read;
+    int i;
+    if (fds == NULL || buffer == NULL)
+    {
+        error_and_exit();
+    }
+    for (i = 0; i < channel_count; i++)
+    {
+        fds[i].fd = i == 0 ? fd : open_file_for_read(path);
+        fds[i].events = POLLIN;
+        set_channel(fds[i].fd, MSG_SLOT_CHANNEL, atoi(channels[i]));
+    }
+    while (remaining > 0)
+    {
+        if (poll(fds, channel_count, -1) < 0)
+        {
+            error_and_exit();
+        }
+        for (i = 0; i < channel_count; i++)
+        {
+            if (fds[i].fd < 0 || fds[i].revents == 0)
+            {
+                continue;
+            }
+            bytes_read = read_update(fds[i].fd, buffer);
+            if (bytes_read >= 0)
+            {
+                print_update(channels[i], channel_count > 1, timestamps, buffer, bytes_read);
+            }
+            else if (errno != EWOULDBLOCK)
+            {
+                fprintf(stderr, "message_reader: channel %s: %s\n", channels[i], strerror(errno));
+                if (i != 0)
+                {
+                    close(fds[i].fd);
+                }
+                fds[i].fd = -1; // poll() skips it from now on
+                remaining--;
+            }
+        }
+    }
+    for (i = 1; i < channel_count; i++)
+    {
+        if (fds[i].fd >= 0)
+        {
+            close(fds[i].fd);
+        }
+    }
+    free(buffer);
+    free(fds);
+    return EXIT_FAILURE;
+}
+
+// Returns the message length, or -1 with errno set
+static int read_update(int fd, char *buffer)
+{
+    return read(fd, buffer, MAX_MESSAGE_SIZE);
+}
+
+static void print_update(const char *channel, int show_channel, int timestamps, const char *message, int length)
+{
+    if (timestamps)
+    {
+        print_timestamp();
+    }
+    if (show_channel && printf("%s ", channel) < 0)
+    {
+        error_and_exit();
+    }
+    if (fwrite(message, 1, length, stdout) != (size_t)length || putchar('\n') == EOF || fflush(stdout) != 0)
+    {
+        error_and_exit();
+    }
+}
+
+static void print_timestamp(void)
+{
+    struct timespec now;
+    struct tm utc;
+    char date[32];
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &utc);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &utc);
+    if (printf("%s.%06ldZ ", date, now.tv_nsec / 1000) < 0)
+    {
+        error_and_exit();
+    }
+}
+
 static void error_and_exit(void)
 {
     perror(strerror(errno));
     exit(EXIT_FAILURE);
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
@@ -7,25 +8,66 @@
 #include <sys/ioctl.h>
 #include "message_slot.h"
 
-static void check_arguments(int argc);
+/*
+    Usage: message_sender <file> <channel> <message>
+       or: message_sender <file> --stream [--binary]
+    In stream mode records are read from stdin until EOF, either as lines of
+    "<channel> <message>" or, with --binary, as struct msg_slot_record
+    headers each followed by its message. They are written over the one open
+    file in batches of STREAM_BATCH with MSG_SLOT_BATCH_WRITE. A record that
+    fails is reported on stderr and the rest are still written.
+*/
+
+#define STREAM_OPTION "--stream"
+#define BINARY_OPTION "--binary"
+#define STREAM_BATCH 256
+
+struct Stream
+{
+    struct msg_slot_batch_entry entries[STREAM_BATCH];
+    size_t offsets[STREAM_BATCH]; // of each entry's message in payloads
+    unsigned long numbers[STREAM_BATCH]; // of each entry's record in the input, from 1
+    unsigned int count;
+    char *payloads; // messages of the pending entries, back to back
+    size_t used;
+    size_t capacity;
+    unsigned long records; // read so far, to tell which one failed
+    int failed;
+};
+
+static void check_arguments(int argc, char *argv[]);
+static int is_stream_mode(int argc, char *argv[]);
 static int open_file_for_write(char *path);
 static void set_channel_and_write_message(int fd, unsigned int command_id, int channel_id, char *message);
 static void set_channel(int fd, unsigned int command_id, int channel_id);
 static void write_message(int fd, char *message);
+static int stream_messages(int fd, int binary);
+static int read_text_record(struct Stream *stream, char **line, size_t *line_capacity, int fd);
+static int read_binary_record(struct Stream *stream, int fd);
+static char *add_record(struct Stream *stream, unsigned int channel_id, size_t length, int fd);
+static void flush_records(struct Stream *stream, int fd);
 static void error_and_exit(void);
 
 int main(int argc, char *argv[])
 {
-    check_arguments(argc);
+    check_arguments(argc, argv);
     int fd = open_file_for_write(argv[1]);
-    set_channel_and_write_message(fd, MSG_SLOT_CHANNEL, atoi(argv[2]), argv[3]);
+    int status = SUCCESS;
+    if (is_stream_mode(argc, argv))
+    {
+        status = stream_messages(fd, argc == 4);
+    }
+    else
+    {
+        set_channel_and_write_message(fd, MSG_SLOT_CHANNEL, atoi(argv[2]), argv[3]);
+    }
     close(fd);
-    return SUCCESS;
+    return status;
 }
 
-static void check_arguments(int argc)
+static void check_arguments(int argc, char *argv[])
 {
-    if (argc != 4)
+    if (argc != 4 && !is_stream_mode(argc, argv))
     {
         errno = EINVAL;
         perror("Incorrect number of arguments for message_sender.c");
@@ -33,6 +75,12 @@ static void check_arguments(int argc)
     }
 }
 
+static int is_stream_mode(int argc, char *argv[])
+{
+    return argc >= 3 && strcmp(argv[2], STREAM_OPTION) == 0 &&
+           (argc == 3 || (argc == 4 && strcmp(argv[3], BINARY_OPTION) == 0));
+}
+
 static int open_file_for_write(char *path)
 {
     int fd = open(path, O_WRONLY);
@@ -67,8 +115,139 @@ static void write_message(int fd, char *message)
     }
 }
 
+// Returns SUCCESS, or EXIT_FAILURE if any record was malformed or failed.
+static int stream_messages(int fd, int binary)
+{
+    struct Stream stream = {0};
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int more = 1;
+    while (more)
+    {
+        more = binary ? read_binary_record(&stream, fd) : read_text_record(&stream, &line, &line_capacity, fd);
+    }
+    flush_records(&stream, fd);
+    free(line);
+    free(stream.payloads);
+    return stream.failed ? EXIT_FAILURE : SUCCESS;
+}
+
+// Returns 0 at EOF.
+static int read_text_record(struct Stream *stream, char **line, size_t *line_capacity, int fd)
+{
+    char *message;
+    unsigned long channel_id;
+    ssize_t length = getline(line, line_capacity, stdin);
+    if (length < 0)
+    {
+        return 0;
+    }
+    stream->records++;
+    if ((*line)[length - 1] == '\n')
+    {
+        length--;
+    }
+    errno = 0;
+    channel_id = strtoul(*line, &message, 10);
+    if (message == *line || *message != ' ' || errno != 0 || channel_id > UINT32_MAX)
+    {
+        fprintf(stderr, "message_sender: record %lu: expected \"<channel> <message>\"\n", stream->records);
+        stream->failed = 1;
+        return 1;
+    }
+    message++;
+    length -= message - *line;
+    memcpy(add_record(stream, channel_id, length, fd), message, length);
+    return 1;
+}
+
+// Returns 0 at EOF.
+static int read_binary_record(struct Stream *stream, int fd)
+{
+    struct msg_slot_record record;
+    char *message;
+    if (fread(&record, sizeof(record), 1, stdin) != 1)
+    {
+        return 0;
+    }
+    stream->records++;
+    if (record.length > MAX_MESSAGE_SIZE)
+    { // the stream can't be resynchronized past a bad header
+        fprintf(stderr, "message_sender: record %lu: length %u exceeds %d\n", stream->records, record.length, MAX_MESSAGE_SIZE);
+        stream->failed = 1;
+        return 0;
+    }
+    message = add_record(stream, record.channel_id, record.length, fd);
+    if (fread(message, 1, record.length, stdin) != record.length)
+    {
+        fprintf(stderr, "message_sender: record %lu: truncated message\n", stream->records);
+        stream->failed = 1;
+        stream->count--;
+        stream->used -= record.length;
+        return 0;
+    }
+    return 1;
+}
+
+// Queues a record and returns where its message must be copied to.
+static char *add_record(struct Stream *stream, unsigned int channel_id, size_t length, int fd)
+{
+    struct msg_slot_batch_entry *entry;
+    if (stream->count == STREAM_BATCH)
+    {
+        flush_records(stream, fd);
+    }
+    if (stream->used + length > stream->capacity)
+    {
+        stream->capacity = 2 * (stream->used + length);
+        stream->payloads = realloc(stream->payloads, stream->capacity);
+        if (stream->payloads == NULL)
+        {
+            error_and_exit();
+        }
+    }
+    entry = &stream->entries[stream->count];
+    entry->channel_id = channel_id;
+    entry->length = length;
+    stream->offsets[stream->count] = stream->used;
+    stream->numbers[stream->count] = stream->records;
+    stream->count++;
+    stream->used += length;
+    return stream->payloads + stream->offsets[stream->count - 1];
+}
+
+// The buffers are only pointed at here, since payloads may have moved while growing.
+static void flush_records(struct Stream *stream, int fd)
+{
+    struct msg_slot_batch batch = {(uintptr_t)stream->entries, stream->count, 0};
+    unsigned int i;
+    if (stream->count == 0)
+    {
+        return;
+    }
+    for (i = 0; i < stream->count; i++)
+    {
+        stream->entries[i].buffer = (uintptr_t)(stream->payloads + stream->offsets[i]);
+    }
+    if (ioctl(fd, MSG_SLOT_BATCH_WRITE, &batch) < 0)
+    {
+        error_and_exit();
+    }
+    for (i = 0; i < stream->count; i++)
+    {
+        if (stream->entries[i].result < 0)
+        {
+            fprintf(stderr, "message_sender: record %lu (channel %u): %s\n", stream->numbers[i],
+                    stream->entries[i].channel_id, strerror(-stream->entries[i].result));
+            stream->failed = 1;
+        }
+    }
+    stream->count = 0;
+    stream->used = 0;
+}
+
 static void error_and_exit(void)
 {
     perror(strerror(errno));
     exit(EXIT_FAILURE);
-}
\ No newline at end of file
+}
@@ -10,494 +10,2850 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
+#include <linux/xarray.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/percpu.h>
+#include <linux/moduleparam.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/uio.h>
+#include <linux/refcount.h>
+#include <linux/atomic.h>
+#include <linux/shrinker.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 #include "message_slot.h"
+#include "message_slot_core.h"
+#define CREATE_TRACE_POINTS
+#include "message_slot_trace.h"
 
 MODULE_LICENSE("GPL");
 
 //================== DATA STRUCTURES ===========================
 /*
-    Each Slot comprises Channels which are linked to each other.
-    The Slots make up a linked list of the minor nodes we need.
+    Each Slot comprises Channels, indexed by ID in an xarray so that lookup,
+    insertion and teardown cost the same however many channels a slot holds.
+    The Slots are indexed by minor number in a second xarray, so opening a
+    device file costs the same however many minors have been created.
     Each Channel has an ID and a message.
+
+    There is no global cursor: every open file carries a File_Context naming
+    its Slot and (once ioctl has been invoked) its Channel, and every function
+    below is handed the structs it works on.
+    Locking is fine-grained:
+    - Slot.lock serializes structural changes (creating channels) in one slot.
+    - Channel.lock serializes writers publishing a new message on a channel.
+    Lookups go through the xarrays without taking either lock, so operations
+    on different channels never contend.
+    A writer builds the new Message off to the side and swaps it in with
+    rcu_assign_pointer(), so readers take no locks. Every Channel embeds a
+    double buffer of two Messages: the writer always fills the one that is
+    not published and then publishes it, so overwriting a channel never
+    touches the allocator. Since a buffer is recycled while late readers may
+    still be copying it, each Message carries a seqcount and readers retry if
+    it changed under them. Either way a reader sees the old or the new
+    message, never a torn one.
+    Every publication bumps the channel's version, and each open file
+    remembers the last version it read, so poll() reports a channel readable
+    only when it holds a message the file has not seen yet. Readers sleeping
+    on an empty channel (see blocking_io) and pollers wait on
+    Channel.readers, which writers wake only if someone is waiting.
+    A channel can be switched into queue mode with MSG_SLOT_QUEUE_MODE. It
+    then keeps a ring of up to queue_capacity messages instead of the double
+    buffer: writes append (failing or sleeping on Channel.writers when the
+    ring is full) and reads consume the oldest message. Queue mode is
+    entirely under Channel.lock; the lockless read path only serves the
+    default overwrite mode.
+    Broadcast mode (MSG_SLOT_BROADCAST_MODE) reuses the queue as a bounded
+    history: a write to a full history drops its oldest message instead of
+    waiting, and reads leave messages in place. The message at queue
+    position i always has version Channel.version - queue_count + 1 + i,
+    so File_Context.seen_version doubles as the file's cursor into the
+    history. Readers copy a message out of the queue under Channel.lock (or
+    take a reference to its Large_Message), so all subscribers share the
+    one copy the writer stored.
+    mmap() on a file bound to a channel maps a read-only msg_slot_ring (see
+    message_slot.h) which is allocated on the first mmap of that channel.
+    From then on every write is mirrored into the ring under Channel.lock,
+    so readers can follow the channel from shared memory without syscalls.
+    MSG_SLOT_BATCH_WRITE and MSG_SLOT_BATCH_READ move one message on each of
+    many channels of the file's slot in a single syscall, going through the
+    same write and read paths as write() and read() but never blocking.
+    MSG_SLOT_READ_IF_CHANGED lets a consumer that polls a channel skip the
+    copy when the channel still holds the version it last read: it compares
+    that against Channel.version (without any lock, like poll()) and only
+    then takes the usual lockless read path.
+    MSG_SLOT_OFFSET_ADDRESSING switches a file to using the pread()/pwrite()
+    offset as the channel ID, so one file reaches any channel of its slot in
+    a single syscall and can be shared by threads without ioctl races.
+    Messages may be longer than BUF_LEN, up to the max_message_size module
+    parameter or a per-channel limit set with MSG_SLOT_MAX_MESSAGE_SIZE.
+    Short messages keep the allocation-free path above; a longer one gets a
+    refcounted, kvmalloc()ed Large_Message that the Message (or
+    Queued_Message) points at. Lockless readers take a reference to it
+    inside their RCU section and copy it out afterwards, so a large payload
+    is freed only once it is neither stored nor being read.
+    Everything a user can make the module allocate is charged to their memcg
+    and counted against optional per-slot and global quotas (see
+    max_channels and max_bytes below); going over fails with -EDQUOT. Under
+    memory pressure a shrinker evicts large overwrite-mode messages nobody
+    has written or read lately, counting them in evicted_messages and
+    evicted_bytes; each scan resumes where the last one stopped.
+    Every read and write path copies through an iov_iter, so readv(),
+    writev() and io_uring work on channels; the mode a request runs in
+    (Wait_Mode) decides whether it may sleep for a message, queue room or
+    just Channel.lock, which IOCB_NOWAIT requests never do. A read into a
+    buffer that faults partway fails with -EFAULT after filling the part
+    before the fault; unlike the original byte-by-byte copy, the user
+    buffer is not restored.
+    Slots and Channels come from dedicated, unmerged slab caches (visible
+    as message_slot_slot and message_slot_channel in /proc/slabinfo). A
+    Channel is refcounted: the index holds a reference, as does every file
+    set to it and every operation in flight, which takes its reference
+    inside an RCU section so that MSG_SLOT_DELETE_CHANNEL can remove a
+    channel at any time and free it with the last put. The one exception
+    is a read of a file's own channel holding a message in overwrite mode,
+    which snapshots it inside an RCU section and so never touches the
+    shared refcount. A Slot counts its open files; with reclaim_on_close,
+    closing the last one frees the slot's empty channels and then, if none
+    are left, the slot.
+    Lock order is slots_lock, Slot.lock, Channel.lock.
+    Opens, ioctls, reads and writes are counted and timed into per-CPU
+    Stats, once for their Slot and once globally, readable from
+    <debugfs>/message_slot/stats and <debugfs>/message_slot/<minor>/stats
+    and cleared by writing to the reset file next to them. The same calls,
+    and slot cleanup, also fire the tracepoints in message_slot_trace.h.
+    <debugfs>/message_slot/snapshot dumps every slot, channel and message
+    in the binary format described in message_slot.h, and writing such an
+    image back restores it, e.g. after reloading the module. The dump holds
+    slots_lock and each Channel.lock in turn, so every channel is
+    consistent but the image as a whole is not a point in time. Restoring
+    goes through the same paths as writes and is meant for a fresh module:
+    channels that already exist get the image's settings and messages
+    stored on top of theirs.
+    struct Channel, its index and its message store live in
+    message_slot_core.h, which also builds in userspace over
+    message_slot_shim.h so core_bench can measure them without the module.
 */
 
+// Entry points timed and counted in a Stats
+enum Stat_Path
+{
+    PATH_OPEN,
+    PATH_IOCTL,
+    PATH_READ,
+    PATH_WRITE,
+    NR_PATHS,
+};
+
+// Bucket b counts calls that took [2^(b-1), 2^b) ns; the last one also
+// counts anything slower.
+#define LATENCY_BUCKETS 32
+
+struct Path_Stats
+{
+    unsigned long calls;
+    unsigned long bytes; // moved by successful reads and writes
+    unsigned long wouldblock;
+    unsigned long nospc;
+    unsigned long errors; // any other failure
+    unsigned long latency[LATENCY_BUCKETS];
+};
+
+// Kept per CPU, so recording a call never touches a shared cache line
+struct Stats
+{
+    struct Path_Stats paths[NR_PATHS];
+};
+
 struct Slot
 {
     int minor;
-    struct Slot *next_slot;
     uint32_t channel_count;
-    struct Channel *channel_linked_list_head;
-    struct Channel *current_channel;
+    atomic_long_t bytes; // charged against max_bytes_per_slot
+    atomic_t open_files; // drops to 0 only under slots_lock
+    struct xarray channels;
+    struct mutex lock;
+    struct rcu_head rcu;
+    struct Stats __percpu *stats;
+    struct dentry *debugfs_dir; // <debugfs>/message_slot/<minor>
+};
+
+// Payload of a message longer than BUF_LEN. Every Message or Queued_Message
+// pointing at it holds a reference, and so does every reader copying it out.
+struct Large_Message
+{
+    struct rcu_head rcu;
+    refcount_t refs;
+    struct Slot *slot; // charged with size until the payload is freed
+    size_t size;
+    char data[];
+};
+
+struct Queued_Message
+{
+    ssize_t length;
+    char data[BUF_LEN];
+    struct Large_Message *large; // as in struct Message
+};
+
+// How far a read or write may go when it can't complete right away
+enum Wait_Mode
+{
+    WAIT_NEVER,    // IOCB_NOWAIT: not even for Channel.lock, fail with -EAGAIN
+    WAIT_FOR_LOCK, // the default: fail with -EWOULDBLOCK if there's no message or room
+    WAIT_FOR_DATA, // blocking_io on a blocking file: sleep until there is
+};
+
+struct File_Context
+{
+    struct Slot *slot;
+    struct Channel *channel;
+    u64 seen_version; // of the last message read from channel
+    u64 missed; // broadcast messages dropped before this file read them, not yet reported
+    bool offset_addressing; // pread/pwrite offsets name the channel, see MSG_SLOT_OFFSET_ADDRESSING
+};
+// What the bytes written next to the snapshot file belong to
+enum Restore_Step
+{
+    RESTORE_HEADER,
+    RESTORE_CHANNEL,
+    RESTORE_LENGTH,
+    RESTORE_DATA,
 };
 
-struct Channel
+// Per open file of <debugfs>/message_slot/snapshot
+struct Snapshot
 {
-    int channel_id;
-    char *message;
-    ssize_t message_length;
-    struct Channel *next;
+    // Dumping: the channel at the seq_file's current position
+    unsigned long minor;
+    unsigned long channel_id;
+    // Restoring
+    enum Restore_Step step;
+    int error; // once a write fails, so do all later ones
+    union
+    {
+        struct msg_slot_snapshot_header header;
+        struct msg_slot_snapshot_channel channel;
+        __u32 length;
+    } pending; // the fixed-size part being received
+    size_t received; // of pending, or of the message data in RESTORE_DATA
+    unsigned int messages_left; // of the channel being restored
+    __u32 length; // of the message being received
+    char data[BUF_LEN]; // holds it if it is short
+    struct Large_Message *large; // holds it otherwise
+    struct Slot *slot; // being restored, with its open_files count raised
+    struct Channel *channel; // being restored, with a reference
 };
 // These are treated as "private" variables
-static struct Slot *slot_linked_list_head = NULL;
-static struct Slot *current_slot = NULL;
+static DEFINE_XARRAY(slots);
+// Serializes creating and freeing slots
+static DEFINE_MUTEX(slots_lock);
+static struct kmem_cache *slot_cache;
+static struct kmem_cache *channel_cache;
+// Writes served from a channel's double buffer instead of a fresh allocation,
+// exported read-only as /sys/module/message_slot/parameters/avoided_allocations
+// (as are the other per-CPU counters below)
+static DEFINE_PER_CPU(unsigned long, avoided_allocations);
+// Off by default so that reading an empty channel keeps failing with
+// -EWOULDBLOCK; when set, such reads (and writes to a full queue) sleep
+// unless the file is O_NONBLOCK.
+static bool blocking_io = false;
+module_param(blocking_io, bool, 0644);
+MODULE_PARM_DESC(blocking_io, "Reads on an empty channel and writes to a full queue block unless O_NONBLOCK");
+// Longest message a channel accepts unless set per channel with
+// MSG_SLOT_MAX_MESSAGE_SIZE; anything over BUF_LEN is allocated per write.
+static unsigned int max_message_size = BUF_LEN;
+// Quotas on what users opening the device can make the module allocate,
+// 0 meaning unlimited. Bytes cover channels, queues, rings and large messages.
+static unsigned int max_channels_per_slot = 0;
+module_param(max_channels_per_slot, uint, 0644);
+MODULE_PARM_DESC(max_channels_per_slot, "Channels a slot may hold, 0 for no limit");
+static unsigned int max_channels = 0;
+module_param(max_channels, uint, 0644);
+MODULE_PARM_DESC(max_channels, "Channels all slots together may hold, 0 for no limit");
+static unsigned long max_bytes_per_slot = 0;
+module_param(max_bytes_per_slot, ulong, 0644);
+MODULE_PARM_DESC(max_bytes_per_slot, "Bytes a slot may allocate, 0 for no limit");
+static unsigned long max_bytes = 0;
+module_param(max_bytes, ulong, 0644);
+MODULE_PARM_DESC(max_bytes, "Bytes all slots together may allocate, 0 for no limit");
+// When the last file of a slot is closed, free its channels that hold no
+// messages, and the slot itself if that leaves it without channels.
+static bool reclaim_on_close = false;
+module_param(reclaim_on_close, bool, 0644);
+MODULE_PARM_DESC(reclaim_on_close, "Free empty channels (and then empty slots) when the last file of a slot closes");
+static atomic_t total_channels = ATOMIC_INIT(0);
+static atomic_long_t total_bytes = ATOMIC_LONG_INIT(0);
+// Large messages held by a double buffer, which is all the shrinker can free
+static atomic_long_t buffered_large_messages = ATOMIC_LONG_INIT(0);
+static struct shrinker *message_shrinker;
+// Where the next shrinker scan resumes, protected by slots_lock
+static unsigned long scan_minor;
+static unsigned long scan_channel_id;
+// Large messages (and their bytes) dropped by the shrinker
+static DEFINE_PER_CPU(unsigned long, evicted_messages);
+static DEFINE_PER_CPU(unsigned long, evicted_bytes);
+// Off stops timing and counting calls, for the last few nanoseconds per call
+static bool collect_stats = true;
+module_param(collect_stats, bool, 0644);
+MODULE_PARM_DESC(collect_stats, "Count and time calls for <debugfs>/message_slot");
+static DEFINE_PER_CPU(struct Stats, global_stats);
+static struct dentry *debugfs_root;
+// Batch entries copied to the stack at a time by MSG_SLOT_BATCH_WRITE/READ
+#define BATCH_CHUNK_ENTRIES 16
+// Returned by a read path that finds the channel switched to another mode,
+// so read_channel() dispatches again. Never reaches user space.
+#define MODE_CHANGED (-ECHILD)
 
 // Structs are read & manipulated using getter/setter functions.
 
 //================== DECLARATIONS ===========================
 
-static int append_slot_to_ll(int minor, struct Slot *tail);
+static int find_or_create_slot(int minor, struct Slot **slot);
+
+static int insert_slot_into_index(int minor, struct Slot **slot);
+
+static void initialize_slot(struct Slot *slot, int minor);
+
+static void release_slot(struct Slot *slot);
+
+static void reclaim_slot(struct Slot *slot);
+
+static void free_slot_rcu(struct rcu_head *head);
 
-static ssize_t read_buffer(char __user *buffer, size_t buffer_length, char *message, int message_length);
+static ssize_t read_from_file(struct file *file, loff_t offset, struct iov_iter *to, enum Wait_Mode mode);
 
-static int back_up_user_buffer(char __user *buffer, size_t buffer_length, char *backup_buffer);
+static ssize_t write_to_file(struct file *file, loff_t offset, struct iov_iter *from, enum Wait_Mode mode);
 
-static int restore_user_buffer_on_failure(char __user *buffer, size_t buffer_length, char *backup_buffer);
+static int import_user_buffer(int direction, void __user *buffer, size_t length, struct iov_iter *iter);
 
-static int set_channel_and_check_read_validity(struct file *file, int buffer_length);
+static enum Wait_Mode get_wait_mode(struct file *file, bool nowait);
+
+static int lock_channel(struct Channel *channel, enum Wait_Mode mode);
+
+static ssize_t read_buffer(struct iov_iter *to, char *message, int message_length);
+
+static bool read_bound_channel(struct file *file, struct iov_iter *to, ssize_t *result, unsigned int *channel_id);
+
+static ssize_t read_channel(struct file *file, struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode);
+
+static ssize_t read_message(struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode, u64 *version);
+
+static int take_message_snapshot(struct Channel *channel, char *snapshot, struct Large_Message **large, u64 *version);
+
+static int wait_for_message(struct Channel *channel, char *snapshot, struct Large_Message **large, u64 *version);
+
+static bool channel_has_message(struct Channel *channel);
+
+static ssize_t read_from_queue(struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode);
+
+static ssize_t read_broadcast(struct file *file, struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode);
+
+static ssize_t read_from_history(struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode, u64 *cursor, u64 *missed);
+
+static ssize_t take_from_history(struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode, u64 *cursor, u64 *missed);
+
+static bool history_has_news(struct Channel *channel, u64 cursor);
+
+static ssize_t dequeue_message(struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode);
 
 static int is_valid_read_length(int message_length, int buffer_length);
 
-static ssize_t write_buffer(const char __user *buffer, size_t length);
+static ssize_t write_buffer(struct Channel *channel, struct iov_iter *from, enum Wait_Mode mode);
 
-static int back_up_current_message(char *backup);
+static ssize_t write_large_buffer(struct Channel *channel, struct iov_iter *from, enum Wait_Mode mode);
 
-static void restore_message_on_failure(char *backup, int backup_length);
+static ssize_t store_message(struct Channel *channel, const char *data, size_t length, struct Large_Message *large, enum Wait_Mode mode);
 
-static int set_channel_and_check_write_validity(struct file *file, size_t length);
+static void wake_up_readers(struct Channel *channel);
 
-static int set_channel_from_file(struct file *file);
+static void enqueue_message(struct Channel *channel, const char *data, size_t length, struct Large_Message *large);
 
-static int set_state(int minor, int id);
+static int wait_for_queue_space(struct Channel *channel, enum Wait_Mode mode);
 
-static int search_and_set_slot_by_minor(int minor);
+static bool channel_in_queue_mode(struct Channel *channel);
 
-static int search_and_set_channel_by_id(int id);
+static bool channel_in_broadcast_mode(struct Channel *channel);
 
-static struct Slot *get_current_slot(void);
+static void drop_oldest_message(struct Channel *channel);
 
-static void set_current_slot(struct Slot *slot);
+static bool queue_has_messages(struct Channel *channel);
 
-static struct Slot *get_slot_ll_head(void);
+static bool queue_has_space(struct Channel *channel);
 
-static void set_slot_ll_head(struct Slot *slot);
+static int alloc_large_message(struct Slot *slot, size_t length, struct Large_Message **large);
 
-static int get_current_slot_minor(void);
+static struct Large_Message *get_large_message(struct Large_Message *large);
 
-static void set_current_slot_minor(int minor);
+static void put_large_message(struct Large_Message *large);
 
-static struct Slot *get_next_slot(void);
+static char *get_message_data(struct Message *message);
 
-static void set_next_slot(struct Slot *slot);
+static int get_or_create_ring(struct Channel *channel, struct msg_slot_ring **ring);
 
-static int is_valid_write_length(int length);
+static void mirror_into_ring(struct msg_slot_ring *ring, const char *data, size_t length, u64 version);
 
-static int is_valid_ioctl_op(unsigned int ioctl_command_id, unsigned int channel_id);
+static int get_percpu_counter(char *buffer, const struct kernel_param *kp);
 
-static int find_or_create_channel(unsigned int channel_id);
+static int charge_channel(struct Slot *slot);
 
-static int initialize_slot_channel_ll(unsigned int id);
+static void uncharge_channel(struct Slot *slot);
 
-static int find_or_append_channel_in_existing_ll(unsigned int channel_id);
+static int charge_bytes(struct Slot *slot, size_t size);
 
-static int append_channel_to_ll(unsigned int id, struct Channel *tail);
+static void uncharge_bytes(struct Slot *slot, size_t size);
 
-static void initialize_current_channel(unsigned int id);
+static bool exceeds_limit(unsigned long value, unsigned long limit);
 
-static void write_channel_to_file(struct file *file, struct Channel *channel);
+static int create_shrinker(void);
 
-static int initialize_slot_ll_head(void);
+static int snapshot_open(struct inode *inode, struct file *file);
 
-static void clean_up_slots(void);
+static int snapshot_release(struct inode *inode, struct file *file);
+
+static void *snapshot_start(struct seq_file *file, loff_t *pos);
+
+static void *snapshot_next(struct seq_file *file, void *v, loff_t *pos);
+
+static void snapshot_stop(struct seq_file *file, void *v);
+
+static int snapshot_show(struct seq_file *file, void *v);
+
+static void show_snapshot_message(struct seq_file *file, const char *data, __u32 length);
+
+static struct Channel *find_snapshot_channel(struct Snapshot *snapshot);
+
+static ssize_t snapshot_write(struct file *file, const char __user *buffer, size_t length, loff_t *offset);
+
+static ssize_t restore_bytes(struct Snapshot *snapshot, const char __user *buffer, size_t length);
+
+static int finish_restore_step(struct Snapshot *snapshot);
+
+static int restore_channel(struct Snapshot *snapshot);
+
+static int start_restoring_message(struct Snapshot *snapshot);
+
+static int finish_restoring_message(struct Snapshot *snapshot);
+
+static u64 start_timing(bool traced);
+
+static u64 elapsed_since(u64 start);
+
+static int finish_open(struct inode *inode, struct Slot *slot, u64 start, int result);
+
+static ssize_t finish_transfer(struct file *file, enum Stat_Path path, unsigned int channel_id, size_t length, u64 start, ssize_t result);
 
-static void clean_up_channels(void);
+static void record_call(struct Slot *slot, enum Stat_Path path, u64 elapsed, ssize_t result);
 
-static struct Channel *get_current_channel(void);
+static void record_call_in(struct Stats __percpu *stats, enum Stat_Path path, u64 elapsed, ssize_t result);
 
-static void set_current_channel(struct Channel *channel);
+static struct Stats __percpu *get_stats(struct Slot *slot);
 
-static u_int32_t get_channel_count(void);
+static void create_debugfs(void);
 
-static void set_channel_count(u_int32_t count);
+static void create_slot_debugfs(struct Slot *slot);
 
-static struct Channel *get_slot_channel_ll_head(void);
+static void create_stats_files(struct dentry *dir, struct Slot *slot);
 
-static void set_slot_channel_ll_head(struct Channel *channel);
+static int stats_show(struct seq_file *file, void *unused);
 
-static char *get_current_message(void);
+static void show_path_stats(struct seq_file *file, struct Stats __percpu *stats, enum Stat_Path path);
 
-static void allocate_current_message(size_t size);
+static ssize_t reset_stats(struct file *file, const char __user *buffer, size_t length, loff_t *offset);
 
-static void reset_current_message(void);
+static unsigned long count_buffered_large_messages(struct shrinker *shrinker, struct shrink_control *control);
 
-static int get_current_message_length(void);
+static unsigned long evict_cold_messages(struct shrinker *shrinker, struct shrink_control *control);
 
-static void set_current_message_length(int length);
+static unsigned long evict_if_cold(struct Channel *channel);
 
-static int get_current_channel_id(void);
+static struct Channel *next_channel_to_scan(struct Slot **slot);
 
-static int get_channel_id(struct Channel *channel);
+static void buffer_large_message(struct Large_Message *large);
 
-static void set_current_channel_id(int id);
+static void unbuffer_large_message(struct Large_Message *large);
 
-static struct Channel *get_next_channel(void);
+static void clear_message(struct Message *message);
 
-static void set_next_channel(struct Channel *next_channel);
+static int set_max_message_size(const char *value, const struct kernel_param *kp);
+
+static int get_channel_from_file(struct file *file, struct Channel **channel);
+
+static int get_addressed_channel(struct file *file, loff_t offset, bool create, struct Channel **channel);
+
+static int is_valid_write_length(struct Channel *channel, size_t length);
+
+static unsigned int get_max_message_size(struct Channel *channel);
+
+static int set_channel_from_ioctl(struct file *file, unsigned long channel_id);
+
+static int is_valid_channel_id(unsigned long channel_id);
+
+static int set_queue_mode(struct file *file, unsigned long capacity, bool broadcast);
+
+static int change_queue_mode(struct Channel *channel, unsigned int capacity, bool broadcast);
+
+static long read_broadcast_from_ioctl(struct file *file, struct msg_slot_broadcast_read __user *user_request);
+
+static int set_offset_addressing(struct file *file, unsigned long enabled);
+
+static int set_channel_max_message_size(struct file *file, unsigned long size);
+
+static int resize_queue(struct Channel *channel, unsigned int capacity);
+
+static void move_message_into_queue(struct Channel *channel);
+
+static void move_message_out_of_queue(struct Channel *channel);
+
+static long read_if_changed(struct file *file, struct msg_slot_conditional_read __user *user_request);
+
+static u64 get_published_version(struct Channel *channel);
+
+static long run_batch(struct file *file, struct msg_slot_batch __user *user_batch, bool is_write);
+
+static int batch_write_entry(struct Slot *slot, struct msg_slot_batch_entry *entry);
+
+static int batch_read_entry(struct Slot *slot, struct msg_slot_batch_entry *entry);
+
+static int find_or_create_channel(struct Slot *slot, unsigned int channel_id, struct Channel **channel);
+
+static int find_channel(struct Slot *slot, unsigned int channel_id, struct Channel **channel);
+
+static int delete_channel(struct file *file, unsigned long channel_id);
+
+static void remove_channel_from_index(struct Slot *slot, struct Channel *channel);
+
+static bool channel_is_idle(struct Channel *channel);
+
+static bool channel_deleted(struct Channel *channel);
+
+static void put_channel(struct Channel *channel);
+
+static void destroy_channel(struct Channel *channel);
+
+static void free_channel_rcu(struct rcu_head *head);
+
+static int insert_channel_into_index(struct Slot *slot, unsigned int id, struct Channel **channel);
+
+static void write_channel_to_file(struct file *file, struct Channel *channel);
+
+static int create_caches(void);
+
+static void destroy_caches(void);
+
+static void clean_up_slots(void);
+
+static void clean_up_channels(struct Slot *slot);
+
+static struct File_Context *get_file_context(struct file *file);
+
+static void set_slot_minor(struct Slot *slot, int minor);
+
+static u_int32_t get_channel_count(struct Slot *slot);
+
+static void set_channel_count(struct Slot *slot, u_int32_t count);
+
+static struct xarray *get_slot_channels(struct Slot *slot);
+
+static void initialize_slot_channels(struct Slot *slot);
 
 //================== DEVICE FUNCTIONS ===========================
 static int device_open(struct inode *inode,
                        struct file *file)
 {
+    struct File_Context *context;
+    struct Slot *slot;
+    u64 start = start_timing(trace_msg_slot_open_enabled());
+    int slot_err = find_or_create_slot(iminor(inode), &slot);
+    if (slot_err != SUCCESS)
+    {
+        return finish_open(inode, NULL, start, slot_err);
+    }
+
+    context = (struct File_Context *)kmalloc(sizeof(struct File_Context), GFP_KERNEL_ACCOUNT);
+    if (!context)
+    {
+        finish_open(inode, slot, start, -ENOMEM);
+        release_slot(slot);
+        return -ENOMEM;
+    }
+    context->slot = slot;
+    context->channel = NULL;
+    context->seen_version = 0;
+    context->missed = 0;
+    context->offset_addressing = false;
+    file->private_data = (void *)context;
+    // Without it RWF_NOWAIT fails with -EOPNOTSUPP and io_uring never tries inline
+    file->f_mode |= FMODE_NOWAIT;
+    return finish_open(inode, slot, start, SUCCESS);
+}
+
+// Returns the slot with its open_files count raised for the caller.
+// A slot whose count is 0 may be about to be freed, so it is only revived
+// under slots_lock.
+static int find_or_create_slot(int minor, struct Slot **slot)
+{
+    int insert_err = SUCCESS;
+    rcu_read_lock();
+    *slot = xa_load(&slots, minor);
+    if (*slot != NULL && atomic_inc_not_zero(&(*slot)->open_files))
+    {
+        rcu_read_unlock();
+        return SUCCESS;
+    }
+    rcu_read_unlock();
+
+    mutex_lock(&slots_lock);
+    *slot = xa_load(&slots, minor);
+    if (*slot == NULL)
+    {
+        insert_err = insert_slot_into_index(minor, slot);
+    }
+    if (insert_err == SUCCESS)
+    {
+        atomic_inc(&(*slot)->open_files);
+    }
+    mutex_unlock(&slots_lock);
+    return insert_err;
+}
+
+// Must be called with slots_lock held.
+static int insert_slot_into_index(int minor, struct Slot **slot)
+{
+    int insert_err;
+    struct Slot *new_slot = (struct Slot *)kmem_cache_alloc(slot_cache, GFP_KERNEL);
+    if (!new_slot)
+    {
+        return -ENOMEM;
+    }
+    new_slot->stats = alloc_percpu_gfp(struct Stats, GFP_KERNEL_ACCOUNT);
+    if (!new_slot->stats)
+    {
+        kmem_cache_free(slot_cache, new_slot);
+        return -ENOMEM;
+    }
+    // The slot is fully initialized before it becomes visible in the index
+    initialize_slot(new_slot, minor);
+    insert_err = xa_insert(&slots, minor, new_slot, GFP_KERNEL_ACCOUNT);
+    if (insert_err != SUCCESS)
+    {
+        free_percpu(new_slot->stats);
+        kmem_cache_free(slot_cache, new_slot);
+        return insert_err;
+    }
+    create_slot_debugfs(new_slot);
+    *slot = new_slot;
+    return SUCCESS;
+}
+
+static void initialize_slot(struct Slot *slot, int minor)
+{
+    set_slot_minor(slot, minor);
+    set_channel_count(slot, 0);
+    atomic_long_set(&slot->bytes, 0);
+    atomic_set(&slot->open_files, 0);
+    initialize_slot_channels(slot);
+    mutex_init(&slot->lock);
+}
+
+//---------------------------------------------------------------
+static int device_release(struct inode *inode,
+                          struct file *file)
+{
+    struct File_Context *context = get_file_context(file);
+    put_channel(context->channel);
+    release_slot(context->slot);
+    kfree(context);
+    return SUCCESS;
+}
+
+static void release_slot(struct Slot *slot)
+{
+    if (!atomic_dec_and_mutex_lock(&slot->open_files, &slots_lock))
+    {
+        return;
+    }
+    if (READ_ONCE(reclaim_on_close))
+    {
+        reclaim_slot(slot);
+    }
+    mutex_unlock(&slots_lock);
+}
+
+// Must be called with slots_lock held and no file open on the slot, so
+// nothing but the index references its channels.
+static void reclaim_slot(struct Slot *slot)
+{
+    unsigned long id;
+    struct Channel *channel;
+    bool empty;
+    unsigned int freed = 0;
+    u64 start = start_timing(trace_msg_slot_cleanup_enabled());
+    mutex_lock(&slot->lock);
+    xa_for_each(get_slot_channels(slot), id, channel)
+    {
+        if (channel_is_idle(channel))
+        {
+            remove_channel_from_index(slot, channel);
+            put_channel(channel);
+            freed++;
+        }
+    }
+    empty = get_channel_count(slot) == 0;
+    mutex_unlock(&slot->lock);
+    trace_msg_slot_cleanup(slot->minor, freed, elapsed_since(start));
+    if (!empty)
+    {
+        return;
+    }
+    xa_erase(&slots, slot->minor);
+    debugfs_remove(slot->debugfs_dir); // waits for readers of its files
+    free_percpu(slot->stats);
+    xa_destroy(get_slot_channels(slot));
+    mutex_destroy(&slot->lock);
+    // Opens may still be looking at the slot without holding slots_lock
+    call_rcu(&slot->rcu, free_slot_rcu);
+}
+
+static void free_slot_rcu(struct rcu_head *head)
+{
+    kmem_cache_free(slot_cache, container_of(head, struct Slot, rcu));
+}
+
+//---------------------------------------------------------------
+static ssize_t device_read(struct file *file,
+                           char __user *buffer,
+                           size_t length,
+                           loff_t *offset)
+{
+    struct iov_iter to;
+    int import_err = import_user_buffer(ITER_DEST, buffer, length, &to);
+    if (import_err != SUCCESS)
+    {
+        return import_err;
+    }
+    return read_from_file(file, *offset, &to, get_wait_mode(file, false));
+}
+
+// Serves readv() and io_uring. The overwrite-mode read path takes no locks,
+// so IOCB_NOWAIT reads of such channels complete inline.
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    return read_from_file(iocb->ki_filp, iocb->ki_pos, to, get_wait_mode(iocb->ki_filp, iocb->ki_flags & IOCB_NOWAIT));
+}
+
+// The file offset is never advanced, so in offset addressing mode read()
+// keeps reading the channel last chosen with lseek().
+static ssize_t read_from_file(struct file *file, loff_t offset, struct iov_iter *to, enum Wait_Mode mode)
+{
+    ssize_t result;
+    struct Channel *channel;
+    unsigned int channel_id;
+    size_t length = iov_iter_count(to);
+    u64 start = start_timing(trace_msg_slot_read_enabled());
+    int channel_err;
+    if (!READ_ONCE(get_file_context(file)->offset_addressing) && read_bound_channel(file, to, &result, &channel_id))
+    {
+        return finish_transfer(file, PATH_READ, channel_id, length, start, result);
+    }
+    channel_err = get_addressed_channel(file, offset, mode == WAIT_FOR_DATA, &channel);
+    if (channel_err != SUCCESS)
+    {
+        return finish_transfer(file, PATH_READ, 0, length, start, channel_err);
+    }
+    result = read_channel(file, channel, to, mode);
+    channel_id = channel->channel_id;
+    put_channel(channel);
+    return finish_transfer(file, PATH_READ, channel_id, length, start, result);
+}
+
+// Reads the message of the file's own channel without taking a reference
+// to the channel: the RCU section keeps it from being freed while its
+// message is snapshotted, and destroy_channel() unpublishes the message
+// before putting its payload. Returns false, having read nothing, if the
+// read needs the reference-taking path: no channel yet, a deleted one, one
+// in queue mode, or no message to read.
+static bool read_bound_channel(struct file *file, struct iov_iter *to, ssize_t *result, unsigned int *channel_id)
+{
+    struct File_Context *context = get_file_context(file);
+    char snapshot[BUF_LEN];
+    struct Channel *channel;
+    struct Large_Message *large = NULL;
+    u64 version;
+    int message_length = 0;
+    rcu_read_lock();
+    channel = READ_ONCE(context->channel);
+    if (channel != NULL && !channel_deleted(channel) && !channel_in_queue_mode(channel))
+    {
+        message_length = take_message_snapshot(channel, snapshot, &large, &version);
+    }
+    if (message_length == 0)
+    {
+        rcu_read_unlock();
+        return false;
+    }
+    *channel_id = channel->channel_id;
+    if (large != NULL && !READ_ONCE(channel->referenced))
+    {
+        WRITE_ONCE(channel->referenced, true);
+    }
+    if (channel == READ_ONCE(context->channel))
+    {
+        WRITE_ONCE(context->seen_version, version);
+    }
+    rcu_read_unlock();
+    *result = is_valid_read_length(message_length, iov_iter_count(to));
+    if (*result == SUCCESS)
+    {
+        *result = read_buffer(to, large != NULL ? large->data : snapshot, message_length);
+    }
+    put_large_message(large);
+    return true;
+}
+
+// The mode is checked again under Channel.lock (or, for sleepers, when they
+// wake), and a read that finds it changed starts over in the new one.
+// file is NULL for batch reads, which have no per-file state to update.
+static ssize_t read_channel(struct file *file, struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode)
+{
+    ssize_t result;
+    u64 version;
+    do
+    {
+        if (channel_in_broadcast_mode(channel))
+        {
+            result = read_broadcast(file, channel, to, mode);
+        }
+        else if (channel_in_queue_mode(channel))
+        {
+            result = read_from_queue(channel, to, mode);
+        }
+        else
+        {
+            result = read_message(channel, to, mode, &version);
+            if (result >= 0 && file != NULL && channel == READ_ONCE(get_file_context(file)->channel))
+            {
+                WRITE_ONCE(get_file_context(file)->seen_version, version);
+            }
+        }
+    } while (result == MODE_CHANGED);
+    return result;
+}
+
+// Reads the current message of a channel in overwrite mode.
+static ssize_t read_message(struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode, u64 *version)
+{
+    char snapshot[BUF_LEN];
+    struct Large_Message *large = NULL;
+    int message_length;
+    ssize_t result;
+    message_length = take_message_snapshot(channel, snapshot, &large, version);
+    if (message_length == 0 && channel_in_queue_mode(channel))
+    { // the message may have just been moved into the queue
+        return MODE_CHANGED;
+    }
+    if (message_length == 0 && mode == WAIT_FOR_DATA)
+    {
+        message_length = wait_for_message(channel, snapshot, &large, version);
+        if (message_length < 0)
+        {
+            return message_length;
+        }
+    }
+    result = is_valid_read_length(message_length, iov_iter_count(to));
+    if (result == SUCCESS)
+    {
+        result = read_buffer(to, large != NULL ? large->data : snapshot, message_length);
+    }
+    if (large != NULL && !READ_ONCE(channel->referenced))
+    {
+        WRITE_ONCE(channel->referenced, true);
+    }
+    put_large_message(large);
+    return result;
+}
+
+// Sleeps until the channel holds a message, then snapshots it.
+// Returns the message length, -ERESTARTSYS if interrupted by a signal or
+// MODE_CHANGED if the channel left overwrite mode meanwhile.
+static int wait_for_message(struct Channel *channel, char *snapshot, struct Large_Message **large, u64 *version)
+{
+    int message_length = 0;
+    while (message_length == 0)
+    {
+        if (wait_event_interruptible(channel->readers, channel_has_message(channel) || channel_deleted(channel) ||
+                                                           channel_in_queue_mode(channel)) != 0)
+        {
+            return -ERESTARTSYS;
+        }
+        if (channel_deleted(channel))
+        {
+            return -EIDRM;
+        }
+        if (channel_in_queue_mode(channel))
+        {
+            return MODE_CHANGED;
+        }
+        message_length = take_message_snapshot(channel, snapshot, large, version);
+    }
+    return message_length;
+}
+
+// read() and write() keep their own entry points (rather than going through
+// the _iter ones) so that a NULL buffer fails with -EINVAL as it always has.
+static int import_user_buffer(int direction, void __user *buffer, size_t length, struct iov_iter *iter)
+{
+    if (!buffer || import_ubuf(direction, buffer, length, iter) != 0)
+    {
+        return -EINVAL;
+    }
+    return SUCCESS;
+}
+
+static enum Wait_Mode get_wait_mode(struct file *file, bool nowait)
+{
+    if (nowait)
+    {
+        return WAIT_NEVER;
+    }
+    return READ_ONCE(blocking_io) && !(file->f_flags & O_NONBLOCK) ? WAIT_FOR_DATA : WAIT_FOR_LOCK;
+}
+
+static int lock_channel(struct Channel *channel, enum Wait_Mode mode)
+{
+    if (mode == WAIT_NEVER)
+    {
+        return mutex_trylock(&channel->lock) ? SUCCESS : -EAGAIN;
+    }
+    mutex_lock(&channel->lock);
+    return SUCCESS;
+}
+
+static bool channel_has_message(struct Channel *channel)
+{
+    return rcu_access_pointer(channel->message) != NULL;
+}
+
+static ssize_t read_from_queue(struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode)
+{
+    ssize_t result = dequeue_message(channel, to, mode);
+    while (result == -EWOULDBLOCK && mode == WAIT_FOR_DATA)
+    {
+        if (wait_event_interruptible(channel->readers, queue_has_messages(channel) || channel_deleted(channel) ||
+                                                           !channel_in_queue_mode(channel) || channel_in_broadcast_mode(channel)) != 0)
+        {
+            return -ERESTARTSYS;
+        }
+        if (channel_deleted(channel))
+        {
+            return -EIDRM;
+        }
+        result = dequeue_message(channel, to, mode);
+    }
+    return result;
+}
+
+// The lock is held across the copy to user space so that the oldest message
+// is consumed only if it was delivered, and by exactly one reader.
+static ssize_t dequeue_message(struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode)
+{
+    struct Queued_Message *oldest;
+    ssize_t result = lock_channel(channel, mode);
+    if (result != SUCCESS)
+    {
+        return result;
+    }
+    if (channel->queue_capacity == 0 || channel->broadcast)
+    { // a broadcast history must never be consumed by one reader
+        mutex_unlock(&channel->lock);
+        return MODE_CHANGED;
+    }
+    if (channel->queue_count == 0)
+    {
+        mutex_unlock(&channel->lock);
+        return -EWOULDBLOCK;
+    }
+    oldest = &channel->queue[channel->queue_head];
+    result = is_valid_read_length(oldest->length, iov_iter_count(to));
+    if (result == SUCCESS)
+    {
+        result = read_buffer(to, oldest->large != NULL ? oldest->large->data : oldest->data, oldest->length);
+    }
+    if (result >= 0)
+    {
+        drop_oldest_message(channel);
+    }
+    mutex_unlock(&channel->lock);
+    if (result >= 0 && wq_has_sleeper(&channel->writers))
+    {
+        wake_up_interruptible_poll(&channel->writers, EPOLLOUT | EPOLLWRNORM);
+    }
+    return result;
+}
+
+// Only the file's own channel has a cursor in the file; any other (and any
+// batch read, with a NULL file) starts from the oldest message every time.
+static ssize_t read_broadcast(struct file *file, struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode)
+{
+    struct File_Context *context = file != NULL ? get_file_context(file) : NULL;
+    bool own_channel = context != NULL && channel == READ_ONCE(context->channel);
+    u64 cursor = own_channel ? READ_ONCE(context->seen_version) : 0;
+    u64 missed = 0;
+    ssize_t result = read_from_history(channel, to, mode, &cursor, &missed);
+    if (result >= 0 && own_channel)
+    {
+        WRITE_ONCE(context->seen_version, cursor);
+        WRITE_ONCE(context->missed, context->missed + missed);
+    }
+    return result;
+}
+
+static ssize_t read_from_history(struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode, u64 *cursor, u64 *missed)
+{
+    ssize_t result = take_from_history(channel, to, mode, cursor, missed);
+    while (result == -EWOULDBLOCK && mode == WAIT_FOR_DATA)
+    {
+        if (wait_event_interruptible(channel->readers, history_has_news(channel, *cursor) || channel_deleted(channel)) != 0)
+        {
+            return -ERESTARTSYS;
+        }
+        if (channel_deleted(channel))
+        {
+            return -EIDRM;
+        }
+        result = take_from_history(channel, to, mode, cursor, missed);
+    }
+    return result;
+}
+
+// Reads the message after *cursor, or the oldest one held if that was
+// already dropped, adding the messages skipped to *missed (unless this is
+// the first read, with *cursor 0) and moving *cursor to the message read.
+// The lock is only held to copy a short message or take a reference to a
+// long one, so writers never wait for a copy to user space.
+static ssize_t take_from_history(struct Channel *channel, struct iov_iter *to, enum Wait_Mode mode, u64 *cursor, u64 *missed)
+{
+    char snapshot[BUF_LEN];
+    struct Queued_Message *queued;
+    struct Large_Message *large;
+    u64 oldest;
+    u64 version;
+    ssize_t length;
+    ssize_t result = lock_channel(channel, mode);
+    if (result != SUCCESS)
+    {
+        return result;
+    }
+    if (!channel->broadcast)
+    {
+        mutex_unlock(&channel->lock);
+        return MODE_CHANGED;
+    }
+    if (channel->queue_count == 0 || *cursor >= channel->version)
+    {
+        mutex_unlock(&channel->lock);
+        return -EWOULDBLOCK;
+    }
+    oldest = channel->version - channel->queue_count + 1;
+    version = max(*cursor + 1, oldest);
+    queued = &channel->queue[(channel->queue_head + (version - oldest)) % channel->queue_capacity];
+    length = queued->length;
+    large = get_large_message(queued->large);
+    if (large == NULL)
+    {
+        memcpy(snapshot, queued->data, length);
+    }
+    mutex_unlock(&channel->lock);
+    result = is_valid_read_length(length, iov_iter_count(to));
+    if (result == SUCCESS)
+    {
+        result = read_buffer(to, large != NULL ? large->data : snapshot, length);
+    }
+    put_large_message(large);
+    if (result >= 0)
+    {
+        *missed += *cursor != 0 ? version - *cursor - 1 : 0;
+        *cursor = version;
+    }
+    return result;
+}
+
+// Also true once the channel leaves broadcast mode, so waiters move on.
+static bool history_has_news(struct Channel *channel, u64 cursor)
+{
+    return (queue_has_messages(channel) && READ_ONCE(channel->version) != cursor) || !channel_in_broadcast_mode(channel);
+}
+
+// The message is staged in kernel memory, so this is a single bulk copy,
+// scattered across the iovecs of the iterator if there are several.
+// Nothing is faulted in beforehand, since that would walk the page tables
+// under mmap_lock on every read: a buffer that is only partly writable gets
+// the bytes that fit before the fault and the read fails with -EFAULT.
+static ssize_t read_buffer(struct iov_iter *to, char *message, int message_length)
+{
+    if (copy_to_iter(message, message_length, to) != message_length)
+    {
+        return -EFAULT;
+    }
+    return message_length;
+}
+
+// Copies the published message into snapshot without taking any lock, since
+// copying to user space may fault and so cannot happen inside the RCU section.
+// Retries if the buffer was recycled by a writer mid-copy.
+// A message longer than BUF_LEN isn't copied: *large is set to its payload
+// instead, with a reference the caller must put.
+// Returns the message length, 0 if the channel holds no message.
+static int take_message_snapshot(struct Channel *channel, char *snapshot, struct Large_Message **large, u64 *version)
+{
+    struct Message *message;
+    unsigned int seq;
+    int message_length = 0;
+    rcu_read_lock();
+    for (;;)
+    {
+        message = rcu_dereference(channel->message);
+        if (message == NULL)
+        { // may have been cleared (evicted, moved into a queue) since a pass that needs retrying
+            message_length = 0;
+            break;
+        }
+        seq = read_seqcount_begin(&message->seq);
+        *version = READ_ONCE(message->version);
+        message_length = READ_ONCE(message->length);
+        if (message_length <= BUF_LEN)
+        {
+            memcpy(snapshot, message->data, message_length);
+        }
+        else
+        { // the payload can't be freed before the RCU section ends
+            *large = get_large_message(READ_ONCE(message->large));
+        }
+        if (!read_seqcount_retry(&message->seq, seq) && (message_length <= BUF_LEN || *large != NULL))
+        {
+            break;
+        }
+        put_large_message(*large);
+        *large = NULL;
+    }
+    rcu_read_unlock();
+    return message_length;
+}
+
+static int is_valid_read_length(int message_length, int buffer_length)
+{
+    if (message_length < 1)
+    {
+        return -EWOULDBLOCK;
+    }
+    return buffer_length < message_length ? -ENOSPC : SUCCESS;
+}
+
+//---------------------------------------------------------------
+static ssize_t device_write(struct file *file,
+                            const char __user *buffer,
+                            size_t length,
+                            loff_t *offset)
+{
+    struct iov_iter from;
+    int import_err = import_user_buffer(ITER_SOURCE, (void __user *)buffer, length, &from);
+    if (import_err != SUCCESS)
+    {
+        return import_err;
+    }
+    return write_to_file(file, *offset, &from, get_wait_mode(file, false));
+}
+
+// Serves writev() and io_uring: the iovecs are gathered into one message.
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    return write_to_file(iocb->ki_filp, iocb->ki_pos, from, get_wait_mode(iocb->ki_filp, iocb->ki_flags & IOCB_NOWAIT));
+}
+
+// Creating a channel takes Slot.lock and allocates, so an IOCB_NOWAIT write
+// to an offset-addressed channel that doesn't exist yet fails with -EAGAIN
+// and is retried by io_uring from a context that may block.
+static ssize_t write_to_file(struct file *file, loff_t offset, struct iov_iter *from, enum Wait_Mode mode)
+{
+    ssize_t result;
+    struct Channel *channel;
+    unsigned int channel_id;
+    size_t length = iov_iter_count(from);
+    u64 start = start_timing(trace_msg_slot_write_enabled());
+    int channel_err = get_addressed_channel(file, offset, mode != WAIT_NEVER, &channel);
+    if (channel_err != SUCCESS)
+    {
+        return finish_transfer(file, PATH_WRITE, 0, length, start, channel_err);
+    }
+
+    result = is_valid_write_length(channel, length);
+    if (result == SUCCESS)
+    {
+        result = write_buffer(channel, from, mode);
+    }
+    channel_id = channel->channel_id;
+    put_channel(channel);
+    return finish_transfer(file, PATH_WRITE, channel_id, length, start, result);
+}
+
+// The message is staged on the stack first, so a failed copy leaves the
+// channel's current message untouched.
+static ssize_t write_buffer(struct Channel *channel, struct iov_iter *from, enum Wait_Mode mode)
+{
+    char staged[BUF_LEN];
+    size_t length = iov_iter_count(from);
+    if (length > BUF_LEN)
+    {
+        return write_large_buffer(channel, from, mode);
+    }
+    if (copy_from_iter(staged, length, from) != length)
+    {
+        return -EFAULT;
+    }
+    return store_message(channel, staged, length, NULL, mode);
+}
+
+// A large message is copied straight into its own allocation. Since that may
+// sleep, IOCB_NOWAIT writes of large messages are left to io_uring's workers.
+static ssize_t write_large_buffer(struct Channel *channel, struct iov_iter *from, enum Wait_Mode mode)
+{
+    struct Large_Message *large;
+    int alloc_err;
+    size_t length = iov_iter_count(from);
+    if (mode == WAIT_NEVER)
+    {
+        return -EAGAIN;
+    }
+    alloc_err = alloc_large_message(channel->slot, length, &large);
+    if (alloc_err != SUCCESS)
+    {
+        return alloc_err;
+    }
+    if (copy_from_iter(large->data, length, from) != length)
+    {
+        put_large_message(large);
+        return -EFAULT;
+    }
+    return store_message(channel, large->data, length, large, mode);
+}
+
+// The mode is checked under channel->lock so a write never lands in the
+// double buffer of a channel that has just switched to queue mode.
+// Takes over the reference to large, which holds data if it isn't NULL.
+static ssize_t store_message(struct Channel *channel, const char *data, size_t length, struct Large_Message *large, enum Wait_Mode mode)
+{
+    int wait_err = wait_for_queue_space(channel, mode);
+    if (wait_err != SUCCESS)
+    {
+        put_large_message(large);
+        return wait_err;
+    }
+    if (channel_in_queue_mode(channel))
+    {
+        if (channel->queue_count == channel->queue_capacity)
+        { // only a broadcast history is written to when full
+            drop_oldest_message(channel);
+        }
+        enqueue_message(channel, data, length, large);
+    }
+    else
+    {
+        buffer_large_message(large);
+        unbuffer_large_message(replace_message(channel, data, length, large));
+        if (large == NULL)
+        {
+            this_cpu_inc(avoided_allocations);
+        }
+    }
+    if (channel->ring != NULL)
+    {
+        mirror_into_ring(channel->ring, data, length, channel->version + 1);
+    }
+    WRITE_ONCE(channel->referenced, true);
+    channel->version++;
+    mutex_unlock(&channel->lock);
+    wake_up_readers(channel);
+    return length;
+}
+
+// wq_has_sleeper() keeps the wait queue lock off the write path when nobody
+// is blocked in read() or registered through poll().
+static void wake_up_readers(struct Channel *channel)
+{
+    if (wq_has_sleeper(&channel->readers))
+    {
+        wake_up_interruptible_poll(&channel->readers, EPOLLIN | EPOLLRDNORM);
+    }
+}
+
+// Must be called with channel->lock held and room in the queue.
+static void enqueue_message(struct Channel *channel, const char *data, size_t length, struct Large_Message *large)
+{
+    struct Queued_Message *newest = &channel->queue[(channel->queue_head + channel->queue_count) % channel->queue_capacity];
+    newest->length = length;
+    newest->large = large;
+    if (large == NULL)
+    {
+        memcpy(newest->data, data, length);
+    }
+    WRITE_ONCE(channel->queue_count, channel->queue_count + 1);
+}
+
+// Returns SUCCESS with channel->lock held once there is room for a write
+// (always, outside queue mode and in broadcast mode), or an error with the
+// lock released.
+static int wait_for_queue_space(struct Channel *channel, enum Wait_Mode mode)
+{
+    int lock_err = lock_channel(channel, mode);
+    if (lock_err != SUCCESS)
+    {
+        return lock_err;
+    }
+    while (channel_in_queue_mode(channel) && !queue_has_space(channel))
+    {
+        mutex_unlock(&channel->lock);
+        if (mode != WAIT_FOR_DATA)
+        {
+            return -EWOULDBLOCK;
+        }
+        if (wait_event_interruptible(channel->writers, queue_has_space(channel) || channel_deleted(channel)) != 0)
+        {
+            return -ERESTARTSYS;
+        }
+        if (channel_deleted(channel))
+        {
+            return -EIDRM;
+        }
+        mutex_lock(&channel->lock);
+    }
+    return SUCCESS;
+}
+
+static bool channel_in_queue_mode(struct Channel *channel)
+{
+    return READ_ONCE(channel->queue_capacity) != 0;
+}
+
+static bool channel_in_broadcast_mode(struct Channel *channel)
+{
+    return READ_ONCE(channel->broadcast);
+}
+
+// Must be called with channel->lock held and a message in the queue.
+static void drop_oldest_message(struct Channel *channel)
+{
+    struct Queued_Message *oldest = &channel->queue[channel->queue_head];
+    put_large_message(oldest->large);
+    oldest->large = NULL;
+    channel->queue_head = (channel->queue_head + 1) % channel->queue_capacity;
+    WRITE_ONCE(channel->queue_count, channel->queue_count - 1);
+}
+
+static bool queue_has_messages(struct Channel *channel)
+{
+    return READ_ONCE(channel->queue_count) != 0;
+}
+
+// Also true once the channel is back in overwrite mode, so waiters move on.
+// A broadcast history always has room, since writes drop its oldest message.
+static bool queue_has_space(struct Channel *channel)
+{
+    return READ_ONCE(channel->queue_count) < READ_ONCE(channel->queue_capacity) || !channel_in_queue_mode(channel) ||
+           channel_in_broadcast_mode(channel);
+}
+
+static int is_valid_write_length(struct Channel *channel, size_t length)
+{
+    return length > get_max_message_size(channel) || length < 1 ? -EMSGSIZE : SUCCESS;
+}
+
+static unsigned int get_max_message_size(struct Channel *channel)
+{
+    unsigned int channel_max = READ_ONCE(channel->max_message_size);
+    return channel_max != 0 ? channel_max : READ_ONCE(max_message_size);
+}
+
+// kvmalloc() falls back to vmalloc for payloads too large to find as
+// contiguous pages. The payload is charged to the slot and to the memcg of
+// the writer.
+static int alloc_large_message(struct Slot *slot, size_t length, struct Large_Message **large)
+{
+    size_t size = struct_size(*large, data, length);
+    int charge_err = charge_bytes(slot, size);
+    if (charge_err != SUCCESS)
+    {
+        return charge_err;
+    }
+    *large = kvmalloc(size, GFP_KERNEL_ACCOUNT);
+    if (*large == NULL)
+    {
+        uncharge_bytes(slot, size);
+        return -ENOMEM;
+    }
+    refcount_set(&(*large)->refs, 1);
+    (*large)->slot = slot;
+    (*large)->size = size;
+    return SUCCESS;
+}
+
+// Returns NULL if large is NULL or already on its way to being freed.
+static struct Large_Message *get_large_message(struct Large_Message *large)
+{
+    return large != NULL && refcount_inc_not_zero(&large->refs) ? large : NULL;
+}
+
+// Lockless readers may still be taking a reference, so the memory itself
+// is only freed after an RCU grace period.
+static void put_large_message(struct Large_Message *large)
+{
+    if (large != NULL && refcount_dec_and_test(&large->refs))
+    {
+        uncharge_bytes(large->slot, large->size);
+        kvfree_rcu(large, rcu);
+    }
+}
+
+// Called as a double buffer takes over a reference to large, which makes
+// it something the shrinker can evict. large may be NULL.
+static void buffer_large_message(struct Large_Message *large)
+{
+    if (large != NULL)
+    {
+        atomic_long_inc(&buffered_large_messages);
+    }
+}
+
+// Puts the reference a double buffer held to large, which may be NULL.
+static void unbuffer_large_message(struct Large_Message *large)
+{
+    if (large != NULL)
+    {
+        atomic_long_dec(&buffered_large_messages);
+        put_large_message(large);
+    }
+}
+
+// Must be called with channel->lock held.
+static char *get_message_data(struct Message *message)
+{
+    return message->large != NULL ? message->large->data : message->data;
+}
+
+static __poll_t device_poll(struct file *file, poll_table *wait)
+{
+    struct Channel *channel;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    u64 version;
+    int channel_err = get_channel_from_file(file, &channel);
+    if (channel_err != SUCCESS)
+    {
+        return EPOLLERR;
+    }
+
+    // A channel being freed detaches its pollers with wake_up_pollfree()
+    poll_wait(file, &channel->readers, wait);
+    if (channel_in_broadcast_mode(channel))
+    {
+        if (queue_has_messages(channel) && READ_ONCE(channel->version) != READ_ONCE(get_file_context(file)->seen_version))
+        {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+    }
+    else if (channel_in_queue_mode(channel))
+    {
+        poll_wait(file, &channel->writers, wait);
+        mask = queue_has_space(channel) ? mask : 0;
+        mask = queue_has_messages(channel) ? mask | EPOLLIN | EPOLLRDNORM : mask;
+    }
+    else
+    {
+        // An evicted message leaves the channel empty without a new version,
+        // and there is nothing to read until the next write
+        version = get_published_version(channel);
+        if (version != 0 && version != READ_ONCE(get_file_context(file)->seen_version))
+        {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+    }
+    put_channel(channel);
+    return mask;
+}
+
+//---------------------------------------------------------------
+// Maps the bound channel's ring read-only; only the whole ring from offset 0.
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct Channel *channel;
+    struct msg_slot_ring *ring;
+    int ring_err;
+    int channel_err = get_channel_from_file(file, &channel);
+    if (channel_err != SUCCESS)
+    {
+        return channel_err;
+    }
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_ALIGN(sizeof(struct msg_slot_ring)))
+    {
+        ring_err = -EINVAL;
+    }
+    else if (vma->vm_flags & VM_WRITE)
+    {
+        ring_err = -EPERM;
+    }
+    else
+    {
+        ring_err = get_or_create_ring(channel, &ring);
+    }
+    if (ring_err == SUCCESS)
+    {
+        vm_flags_clear(vma, VM_MAYWRITE);
+        // The mapping holds its own references to the ring's pages
+        ring_err = remap_vmalloc_range(vma, ring, 0);
+    }
+    put_channel(channel);
+    return ring_err;
+}
+
+// A new ring starts out holding the channel's current message, if any.
+static int get_or_create_ring(struct Channel *channel, struct msg_slot_ring **ring)
+{
+    struct Message *published;
+    mutex_lock(&channel->lock);
+    if (channel->ring == NULL)
+    {
+        if (charge_bytes(channel->slot, PAGE_ALIGN(sizeof(struct msg_slot_ring))) != SUCCESS)
+        {
+            mutex_unlock(&channel->lock);
+            return -EDQUOT;
+        }
+        *ring = vmalloc_user(sizeof(struct msg_slot_ring)); // zeroed and page aligned
+        if (*ring == NULL)
+        {
+            uncharge_bytes(channel->slot, PAGE_ALIGN(sizeof(struct msg_slot_ring)));
+            mutex_unlock(&channel->lock);
+            return -ENOMEM;
+        }
+        (*ring)->capacity = MSG_SLOT_RING_ENTRIES;
+        (*ring)->entry_size = sizeof(struct msg_slot_ring_entry);
+        published = rcu_dereference_protected(channel->message, lockdep_is_held(&channel->lock));
+        if (published != NULL)
+        {
+            mirror_into_ring(*ring, get_message_data(published), published->length, channel->version);
+        }
+        channel->ring = *ring;
+    }
+    *ring = channel->ring;
+    mutex_unlock(&channel->lock);
+    return SUCCESS;
+}
+
+// Must be called with channel->lock held.
+// Follows the per-entry sequence protocol documented in message_slot.h.
+// Only the first BUF_LEN bytes of a large message fit in an entry.
+static void mirror_into_ring(struct msg_slot_ring *ring, const char *data, size_t length, u64 version)
+{
+    struct msg_slot_ring_entry *entry = &ring->entries[version % MSG_SLOT_RING_ENTRIES];
+    WRITE_ONCE(entry->seq, 2 * version - 1);
+    smp_wmb();
+    entry->length = min_t(size_t, length, BUF_LEN);
+    entry->message_length = length;
+    memcpy(entry->data, data, entry->length);
+    smp_store_release(&entry->seq, 2 * version);
+    smp_store_release(&ring->latest_version, version);
+}
+
+//----------------------------------------------------------------
+// Only matters in offset addressing mode, where the position chosen here is
+// the channel plain read() and write() go to. Past U32_MAX there are none.
+static loff_t device_llseek(struct file *file, loff_t offset, int whence)
+{
+    return fixed_size_llseek(file, offset, whence, U32_MAX);
+}
+
+//----------------------------------------------------------------
+static long device_ioctl(struct file *file,
+                         unsigned int ioctl_command_id,
+                         unsigned long ioctl_param)
+{
+    long result;
+    u64 elapsed;
+    u64 start = start_timing(ioctl_command_id == MSG_SLOT_CHANNEL && trace_msg_slot_set_channel_enabled());
+    switch (ioctl_command_id)
+    {
+    case MSG_SLOT_CHANNEL:
+        result = set_channel_from_ioctl(file, ioctl_param);
+        break;
+    case MSG_SLOT_QUEUE_MODE:
+        result = set_queue_mode(file, ioctl_param, false);
+        break;
+    case MSG_SLOT_BROADCAST_MODE:
+        result = set_queue_mode(file, ioctl_param, true);
+        break;
+    case MSG_SLOT_BROADCAST_READ:
+        result = read_broadcast_from_ioctl(file, (struct msg_slot_broadcast_read __user *)ioctl_param);
+        break;
+    case MSG_SLOT_DELETE_CHANNEL:
+        result = delete_channel(file, ioctl_param);
+        break;
+    case MSG_SLOT_MAX_MESSAGE_SIZE:
+        result = set_channel_max_message_size(file, ioctl_param);
+        break;
+    case MSG_SLOT_OFFSET_ADDRESSING:
+        result = set_offset_addressing(file, ioctl_param);
+        break;
+    case MSG_SLOT_READ_IF_CHANGED:
+        result = read_if_changed(file, (struct msg_slot_conditional_read __user *)ioctl_param);
+        break;
+    case MSG_SLOT_BATCH_WRITE:
+        result = run_batch(file, (struct msg_slot_batch __user *)ioctl_param, true);
+        break;
+    case MSG_SLOT_BATCH_READ:
+        result = run_batch(file, (struct msg_slot_batch __user *)ioctl_param, false);
+        break;
+    default:
+        result = -EINVAL;
+    }
+    elapsed = elapsed_since(start);
+    record_call(get_file_context(file)->slot, PATH_IOCTL, elapsed, result);
+    if (ioctl_command_id == MSG_SLOT_CHANNEL)
+    {
+        trace_msg_slot_set_channel(get_file_context(file)->slot->minor, ioctl_param, result, elapsed);
+    }
+    return result;
+}
+
+static int set_channel_from_ioctl(struct file *file, unsigned long channel_id)
+{
+    int validity;
+    int channel_err;
+    struct Channel *channel;
+    validity = is_valid_channel_id(channel_id);
+    if (validity != SUCCESS)
+    {
+        return validity;
+    }
+    channel_err = find_or_create_channel(get_file_context(file)->slot, channel_id, &channel);
+    if (channel_err != SUCCESS)
+    {
+        return channel_err;
+    }
+
+    write_channel_to_file(file, channel);
+    return SUCCESS;
+}
+
+static int is_valid_channel_id(unsigned long channel_id)
+{
+    return channel_id != 0 && channel_id <= U32_MAX ? SUCCESS : -EINVAL;
+}
+
+// A capacity of 0 returns the bound channel to overwrite mode.
+static int set_queue_mode(struct file *file, unsigned long capacity, bool broadcast)
+{
+    int resize_err;
+    struct Channel *channel;
+    int channel_err = get_channel_from_file(file, &channel);
+    if (channel_err != SUCCESS)
+    {
+        return channel_err;
+    }
+    if (capacity > MAX_QUEUE_CAPACITY)
+    {
+        put_channel(channel);
+        return -EINVAL;
+    }
+
+    resize_err = change_queue_mode(channel, capacity, broadcast);
+    put_channel(channel);
+    return resize_err;
+}
+
+// Switching between queue and broadcast mode keeps the messages queued.
+static int change_queue_mode(struct Channel *channel, unsigned int capacity, bool broadcast)
+{
+    int resize_err;
+    mutex_lock(&channel->lock);
+    resize_err = resize_queue(channel, capacity);
+    if (resize_err == SUCCESS)
+    {
+        WRITE_ONCE(channel->broadcast, broadcast && capacity != 0);
+    }
+    mutex_unlock(&channel->lock);
+    // Writers waiting on a full queue re-check against the new capacity,
+    // and readers of a history that is gone stop waiting for it
+    wake_up_interruptible_all(&channel->writers);
+    wake_up_interruptible_all(&channel->readers);
+    return resize_err;
+}
+
+// Must be called with channel->lock held.
+// Keeps queued messages in order; fails with -EBUSY if they would not fit.
+// A broadcast history is trimmed instead, as writes would trim it: its
+// oldest messages are dropped, and on leaving for overwrite mode its newest
+// becomes the current message.
+static int resize_queue(struct Channel *channel, unsigned int capacity)
+{
+    struct Queued_Message *new_queue = NULL;
+    unsigned int i;
+    if (capacity < channel->queue_count && !channel->broadcast)
+    {
+        return -EBUSY;
+    }
+    if (capacity != 0)
+    {
+        if (charge_bytes(channel->slot, capacity * sizeof(struct Queued_Message)) != SUCCESS)
+        {
+            return -EDQUOT;
+        }
+        new_queue = kvmalloc_array(capacity, sizeof(struct Queued_Message), GFP_KERNEL_ACCOUNT);
+        if (!new_queue)
+        {
+            uncharge_bytes(channel->slot, capacity * sizeof(struct Queued_Message));
+            return -ENOMEM;
+        }
+    }
+    while (channel->queue_count > max(capacity, 1U))
+    { // only a broadcast history gets here
+        drop_oldest_message(channel);
+    }
+    if (capacity == 0 && channel->queue_count != 0)
+    {
+        move_message_out_of_queue(channel);
+    }
+    for (i = 0; i < channel->queue_count; i++)
+    {
+        new_queue[i] = channel->queue[(channel->queue_head + i) % channel->queue_capacity];
+    }
+    kvfree(channel->queue);
+    uncharge_bytes(channel->slot, channel->queue_capacity * sizeof(struct Queued_Message));
+    channel->queue = new_queue;
+    channel->queue_head = 0;
+    if (!channel_in_queue_mode(channel) && capacity != 0)
+    {
+        move_message_into_queue(channel);
+    }
+    WRITE_ONCE(channel->queue_capacity, capacity);
+    return SUCCESS;
+}
+
+// Must be called with channel->lock held.
+// On entering queue mode the current message becomes the oldest queued one.
+static void move_message_into_queue(struct Channel *channel)
+{
+    struct Message *published = rcu_dereference_protected(channel->message, lockdep_is_held(&channel->lock));
+    if (published == NULL)
+    {
+        return;
+    }
+    channel->queue[0].length = published->length;
+    channel->queue[0].large = get_large_message(published->large);
+    if (published->large == NULL)
+    {
+        memcpy(channel->queue[0].data, published->data, published->length);
+    }
+    channel->queue_count = 1;
+    rcu_assign_pointer(channel->message, NULL);
+}
+
+// Must be called with channel->lock held and exactly one message queued.
+// The reverse of move_message_into_queue(): the message keeps its version,
+// so files that already read it don't see it as new.
+static void move_message_out_of_queue(struct Channel *channel)
+{
+    struct Queued_Message *newest = &channel->queue[channel->queue_head];
+    struct Message *message = get_unpublished_message(channel);
+    struct Large_Message *retired = message->large;
+    buffer_large_message(newest->large);
+    fill_message(message, newest->data, newest->length, newest->large, channel->version);
+    publish_message(channel, message);
+    unbuffer_large_message(retired);
+    newest->large = NULL;
+    WRITE_ONCE(channel->queue_count, 0);
+}
+
+// Messages already stored are kept even if they exceed the new limit.
+static int set_channel_max_message_size(struct file *file, unsigned long size)
+{
+    struct Channel *channel;
+    int channel_err = get_channel_from_file(file, &channel);
+    if (channel_err != SUCCESS)
+    {
+        return channel_err;
+    }
+    if (size <= MAX_MESSAGE_SIZE)
+    {
+        WRITE_ONCE(channel->max_message_size, size);
+    }
+    put_channel(channel);
+    return size <= MAX_MESSAGE_SIZE ? SUCCESS : -EINVAL;
+}
+
+static int set_offset_addressing(struct file *file, unsigned long enabled)
+{
+    if (enabled > 1)
+    {
+        return -EINVAL;
+    }
+    WRITE_ONCE(get_file_context(file)->offset_addressing, enabled);
+    return SUCCESS;
+}
+
+// Returns the length of the message read, or -EAGAIN if the channel still
+// holds request.version. The message read may be newer than the version
+// checked, if a write lands in between; request.version tells which it was.
+static long read_if_changed(struct file *file, struct msg_slot_conditional_read __user *user_request)
+{
+    struct msg_slot_conditional_read request;
+    struct iov_iter to;
+    struct Channel *channel;
+    u64 version;
+    long result;
+    if (copy_from_user(&request, user_request, sizeof(request)) != 0)
+    {
+        return -EFAULT;
+    }
+    result = get_channel_from_file(file, &channel);
+    if (result != SUCCESS)
+    {
+        return result;
+    }
+    if (channel_in_queue_mode(channel))
+    {
+        result = -EINVAL;
+    }
+    else if (get_published_version(channel) == request.version)
+    {
+        result = -EAGAIN;
+    }
+    else
+    {
+        result = import_user_buffer(ITER_DEST, u64_to_user_ptr(request.buffer), request.length, &to);
+        if (result == SUCCESS)
+        {
+            result = read_message(channel, &to, WAIT_FOR_LOCK, &version);
+            result = result == MODE_CHANGED ? -EINVAL : result; // switched to queue mode meanwhile
+        }
+    }
+    if (result >= 0)
+    {
+        if (channel == READ_ONCE(get_file_context(file)->channel))
+        {
+            WRITE_ONCE(get_file_context(file)->seen_version, version);
+        }
+        if (put_user(version, &user_request->version) != 0)
+        {
+            result = -EFAULT;
+        }
+    }
+    put_channel(channel);
+    return result;
+}
+
+// Never blocks, like the other ioctls that read.
+static long read_broadcast_from_ioctl(struct file *file, struct msg_slot_broadcast_read __user *user_request)
+{
+    struct msg_slot_broadcast_read request;
+    struct File_Context *context = get_file_context(file);
+    struct iov_iter to;
+    struct Channel *channel;
+    long result;
+    if (copy_from_user(&request, user_request, sizeof(request)) != 0)
+    {
+        return -EFAULT;
+    }
+    result = get_channel_from_file(file, &channel);
+    if (result != SUCCESS)
+    {
+        return result;
+    }
+    result = channel_in_broadcast_mode(channel) ? SUCCESS : -EINVAL;
+    if (result == SUCCESS)
+    {
+        result = import_user_buffer(ITER_DEST, u64_to_user_ptr(request.buffer), request.length, &to);
+    }
+    if (result == SUCCESS)
+    {
+        result = read_broadcast(file, channel, &to, WAIT_FOR_LOCK);
+        result = result == MODE_CHANGED ? -EINVAL : result; // left broadcast mode meanwhile
+    }
+    if (result >= 0 && (put_user(READ_ONCE(context->seen_version), &user_request->version) != 0 ||
+                        put_user(xchg(&context->missed, 0), &user_request->missed) != 0))
+    {
+        result = -EFAULT;
+    }
+    put_channel(channel);
+    return result;
+}
+
+// Bumped under Channel.lock just after each publication, so this may trail
+// the published message for a moment but never runs ahead of it.
+// Returns 0 if nothing was written yet.
+static u64 get_published_version(struct Channel *channel)
+{
+    return channel_has_message(channel) ? READ_ONCE(channel->version) : 0;
+}
+
+// Entries are copied in and out in chunks so a large batch needs neither an
+// allocation nor more than a few hundred bytes of stack, and the CPU may be
+// given up between chunks.
+// Returns the number of entries that succeeded; each entry's result holds
+// what write() or read() would have returned for it.
+static long run_batch(struct file *file, struct msg_slot_batch __user *user_batch, bool is_write)
+{
+    struct msg_slot_batch batch;
+    struct msg_slot_batch_entry entries[BATCH_CHUNK_ENTRIES];
+    struct msg_slot_batch_entry __user *user_entries;
+    struct Slot *slot = get_file_context(file)->slot;
+    unsigned int done;
+    unsigned int chunk;
+    unsigned int i;
+    long succeeded = 0;
+    if (copy_from_user(&batch, user_batch, sizeof(batch)) != 0)
+    {
+        return -EFAULT;
+    }
+    if (batch.count > MAX_BATCH_ENTRIES)
+    {
+        return -EINVAL;
+    }
+    user_entries = u64_to_user_ptr(batch.entries);
+    for (done = 0; done < batch.count; done += chunk)
+    {
+        chunk = min_t(unsigned int, batch.count - done, BATCH_CHUNK_ENTRIES);
+        if (copy_from_user(entries, user_entries + done, chunk * sizeof(entries[0])) != 0)
+        {
+            return -EFAULT;
+        }
+        for (i = 0; i < chunk; i++)
+        {
+            entries[i].result = is_write ? batch_write_entry(slot, &entries[i]) : batch_read_entry(slot, &entries[i]);
+            if (entries[i].result >= 0)
+            {
+                succeeded++;
+            }
+        }
+        if (copy_to_user(user_entries + done, entries, chunk * sizeof(entries[0])) != 0)
+        {
+            return -EFAULT;
+        }
+        cond_resched(); // a full batch is thousands of copies
+    }
+    return succeeded;
+}
+
+// Batches never block: a full queue fails the entry with -EWOULDBLOCK.
+static int batch_write_entry(struct Slot *slot, struct msg_slot_batch_entry *entry)
+{
+    struct iov_iter from;
+    struct Channel *channel;
+    int result = is_valid_channel_id(entry->channel_id);
+    if (result != SUCCESS)
+    {
+        return result;
+    }
+    result = import_user_buffer(ITER_SOURCE, u64_to_user_ptr(entry->buffer), entry->length, &from);
+    if (result != SUCCESS)
+    {
+        return result;
+    }
+    result = find_or_create_channel(slot, entry->channel_id, &channel);
+    if (result != SUCCESS)
+    {
+        return result;
+    }
+    result = is_valid_write_length(channel, entry->length);
+    if (result == SUCCESS)
+    {
+        result = write_buffer(channel, &from, WAIT_FOR_LOCK);
+    }
+    put_channel(channel);
+    return result;
+}
+
+// Reading a channel that doesn't exist yet is the same as reading an empty
+// one, so it fails with -EWOULDBLOCK instead of creating the channel.
+static int batch_read_entry(struct Slot *slot, struct msg_slot_batch_entry *entry)
+{
+    int result;
+    struct iov_iter to;
+    struct Channel *channel;
+    int validity = is_valid_channel_id(entry->channel_id);
+    if (validity != SUCCESS)
+    {
+        return validity;
+    }
+    validity = import_user_buffer(ITER_DEST, u64_to_user_ptr(entry->buffer), entry->length, &to);
+    if (validity != SUCCESS)
+    {
+        return validity;
+    }
+    validity = find_channel(slot, entry->channel_id, &channel);
+    if (validity != SUCCESS)
+    {
+        return validity;
+    }
+    result = read_channel(NULL, channel, &to, WAIT_FOR_LOCK);
+    put_channel(channel);
+    return result;
+}
+
+//---------------------------------------------------------------
+// Must be called with slot->lock held.
+static int charge_channel(struct Slot *slot)
+{
+    int charge_err;
+    unsigned int slot_limit = READ_ONCE(max_channels_per_slot);
+    if (slot_limit != 0 && get_channel_count(slot) >= slot_limit)
+    {
+        return -EDQUOT;
+    }
+    if (exceeds_limit(atomic_inc_return(&total_channels), READ_ONCE(max_channels)))
+    {
+        atomic_dec(&total_channels);
+        return -EDQUOT;
+    }
+    charge_err = charge_bytes(slot, sizeof(struct Channel));
+    if (charge_err != SUCCESS)
+    {
+        atomic_dec(&total_channels);
+    }
+    return charge_err;
+}
+
+static void uncharge_channel(struct Slot *slot)
+{
+    uncharge_bytes(slot, sizeof(struct Channel));
+    atomic_dec(&total_channels);
+}
+
+// Charging first and backing out on failure keeps concurrent chargers from
+// overshooting the limits without a lock.
+static int charge_bytes(struct Slot *slot, size_t size)
+{
+    long slot_bytes = atomic_long_add_return(size, &slot->bytes);
+    long all_bytes = atomic_long_add_return(size, &total_bytes);
+    if (exceeds_limit(slot_bytes, READ_ONCE(max_bytes_per_slot)) || exceeds_limit(all_bytes, READ_ONCE(max_bytes)))
+    {
+        uncharge_bytes(slot, size);
+        return -EDQUOT;
+    }
+    return SUCCESS;
+}
+
+static void uncharge_bytes(struct Slot *slot, size_t size)
+{
+    atomic_long_sub(size, &slot->bytes);
+    atomic_long_sub(size, &total_bytes);
+}
+
+static bool exceeds_limit(unsigned long value, unsigned long limit)
+{
+    return limit != 0 && value > limit;
+}
+
+static int create_shrinker(void)
+{
+    message_shrinker = shrinker_alloc(0, "message_slot");
+    if (!message_shrinker)
+    {
+        return -ENOMEM;
+    }
+    message_shrinker->count_objects = count_buffered_large_messages;
+    message_shrinker->scan_objects = evict_cold_messages;
+    shrinker_register(message_shrinker);
+    return SUCCESS;
+}
+
+// Only large messages held by a channel's double buffer are evicted: small
+// ones live inside the Channel and free nothing, and dropping a queued
+// message would break delivery order. So only those are counted.
+// The count is global, not per memcg, so the shrinker isn't
+// SHRINKER_MEMCG_AWARE and runs on global reclaim only.
+static unsigned long count_buffered_large_messages(struct shrinker *shrinker, struct shrink_control *control)
+{
+    unsigned long count = atomic_long_read(&buffered_large_messages);
+    return count != 0 ? count : SHRINK_EMPTY;
+}
+
+// Scans at most nr_to_scan channels, resuming where the last scan stopped,
+// so a call costs the same however many channels there are.
+static unsigned long evict_cold_messages(struct shrinker *shrinker, struct shrink_control *control)
+{
+    struct Slot *slot = NULL;
+    struct Channel *channel;
+    unsigned long scanned = 0;
+    unsigned long freed = 0;
+    // Holding slots_lock and slot->lock keeps slots and channels from being
+    // freed under the scan; reclaim never waits for either.
+    if (!mutex_trylock(&slots_lock))
+    {
+        return SHRINK_STOP;
+    }
+    while (scanned < control->nr_to_scan && (channel = next_channel_to_scan(&slot)) != NULL)
+    {
+        freed += evict_if_cold(channel);
+        scanned++;
+    }
+    if (slot != NULL)
+    {
+        mutex_unlock(&slot->lock);
+    }
+    mutex_unlock(&slots_lock);
+    control->nr_scanned = scanned;
+    return freed;
+}
+
+// Must be called with slots_lock held. *slot is the slot whose lock the
+// caller holds (NULL for none) and is moved along with the cursor.
+// Returns the channel at the cursor and moves the cursor past it, or NULL
+// once the scan has wrapped around to where it started.
+static struct Channel *next_channel_to_scan(struct Slot **slot)
+{
+    struct Channel *channel;
+    bool wrapped = false;
+    for (;;)
+    {
+        if (*slot != NULL)
+        {
+            channel = xa_find(get_slot_channels(*slot), &scan_channel_id, ULONG_MAX, XA_PRESENT);
+            if (channel != NULL)
+            {
+                scan_channel_id++;
+                return channel;
+            }
+            mutex_unlock(&(*slot)->lock);
+            *slot = NULL;
+            scan_minor++;
+            scan_channel_id = 0;
+        }
+        *slot = xa_find(&slots, &scan_minor, ULONG_MAX, XA_PRESENT);
+        if (*slot == NULL)
+        {
+            if (wrapped)
+            {
+                return NULL;
+            }
+            wrapped = true; // past the last slot, start over from the first
+            scan_minor = 0;
+            scan_channel_id = 0;
+            continue;
+        }
+        if (!mutex_trylock(&(*slot)->lock))
+        {
+            *slot = NULL;
+            scan_minor++;
+            scan_channel_id = 0;
+        }
+    }
+}
+
+// A second-chance scheme: a message written or read since the last scan is
+// spared once, and evicted the next time if it has stayed untouched.
+// The channel then reads as empty, as if it had never been written to.
+// A large payload left in the unpublished buffer by an earlier write is
+// dropped right away, since no new reader can reach it.
+// Returns the number of payloads dropped.
+static unsigned long evict_if_cold(struct Channel *channel)
+{
+    struct Message *published;
+    unsigned long freed = 0;
+    int i;
+    if (!mutex_trylock(&channel->lock))
+    { // never wait on writers from reclaim
+        return 0;
+    }
+    published = rcu_dereference_protected(channel->message, lockdep_is_held(&channel->lock));
+    if (published != NULL && published->large != NULL && !READ_ONCE(channel->referenced))
+    {
+        rcu_assign_pointer(channel->message, NULL);
+        this_cpu_inc(evicted_messages);
+        this_cpu_add(evicted_bytes, published->length);
+        published = NULL;
+    }
+    WRITE_ONCE(channel->referenced, false);
+    for (i = 0; i < 2; i++)
+    {
+        if (&channel->buffers[i] != published && channel->buffers[i].large != NULL)
+        {
+            clear_message(&channel->buffers[i]);
+            freed++;
+        }
+    }
+    mutex_unlock(&channel->lock);
+    return freed;
+}
+
+// Must be called with channel->lock held.
+// Lockless readers still holding the buffer see the sequence change and retry.
+static void clear_message(struct Message *message)
+{
+    struct Large_Message *large = message->large;
+    preempt_disable();
+    write_seqcount_begin(&message->seq);
+    message->length = 0;
+    message->large = NULL;
+    write_seqcount_end(&message->seq);
+    preempt_enable();
+    unbuffer_large_message(large);
+}
+
+//---------------------------------------------------------------
+// Returns the channel with a reference the caller must put.
+static int find_or_create_channel(struct Slot *slot, unsigned int channel_id, struct Channel **channel)
+{
+    int insert_err = SUCCESS;
+    if (find_channel(slot, channel_id, channel) == SUCCESS)
+    {
+        return SUCCESS;
+    }
+
+    mutex_lock(&slot->lock);
+    // Re-check under the lock in case another file created it meanwhile
+    *channel = xa_load(get_slot_channels(slot), channel_id);
+    if (*channel == NULL)
+    {
+        insert_err = insert_channel_into_index(slot, channel_id, channel);
+    }
+    if (insert_err == SUCCESS)
+    { // the index's reference keeps it alive while slot->lock is held
+        refcount_inc(&(*channel)->refs);
+    }
+    mutex_unlock(&slot->lock);
+    return insert_err;
+}
+
+// Lockless lookup. Returns the channel with a reference the caller must put,
+// or -EWOULDBLOCK if it doesn't exist, as reading it would.
+static int find_channel(struct Slot *slot, unsigned int channel_id, struct Channel **channel)
+{
+    *channel = lookup_channel(get_slot_channels(slot), channel_id);
+    return *channel != NULL ? SUCCESS : -EWOULDBLOCK;
+}
+
+// Files still set to the channel keep it alive, but fail with -EIDRM from
+// then on; readers and writers sleeping on it are woken to do so.
+static int delete_channel(struct file *file, unsigned long channel_id)
+{
+    struct Slot *slot = get_file_context(file)->slot;
+    struct Channel *channel;
+    int validity = is_valid_channel_id(channel_id);
+    if (validity != SUCCESS)
+    {
+        return validity;
+    }
+    mutex_lock(&slot->lock);
+    channel = xa_load(get_slot_channels(slot), channel_id);
+    if (channel != NULL)
+    {
+        remove_channel_from_index(slot, channel);
+    }
+    mutex_unlock(&slot->lock);
+    if (channel == NULL)
+    {
+        return -ENOENT;
+    }
+    put_channel(channel);
+    return SUCCESS;
+}
+
+// Must be called with slot->lock held. The caller puts the index's reference.
+static void remove_channel_from_index(struct Slot *slot, struct Channel *channel)
+{
+    xa_erase(get_slot_channels(slot), channel->channel_id);
+    set_channel_count(slot, get_channel_count(slot) - 1);
+    WRITE_ONCE(channel->deleted, true);
+    wake_up_interruptible_all(&channel->readers);
+    wake_up_interruptible_all(&channel->writers);
+}
+
+// Only the index references the channel and it holds no message.
+static bool channel_is_idle(struct Channel *channel)
+{
+    return refcount_read(&channel->refs) == 1 && !channel_has_message(channel) && !queue_has_messages(channel);
+}
+
+static bool channel_deleted(struct Channel *channel)
+{
+    return READ_ONCE(channel->deleted);
+}
 
-    int minor = iminor(inode);
-    struct Slot *slot = get_slot_ll_head();
-    while (slot->next_slot != NULL)
+static void put_channel(struct Channel *channel)
+{
+    if (channel != NULL && refcount_dec_and_test(&channel->refs))
     {
-        if (slot->minor == minor)
-        {
-            set_current_slot(slot);
-            return SUCCESS;
-        }
-        slot = slot->next_slot;
+        destroy_channel(channel);
     }
+}
 
-    set_current_slot(slot); // last slot in linked list
-    if (get_current_slot_minor() == minor)
+// Lockless lookups may still reach the channel (and fail to take a
+// reference), so its memory is only freed after an RCU grace period.
+// Readers of a file's own channel may still be snapshotting its message,
+// so it is unpublished before its payload is put.
+static void destroy_channel(struct Channel *channel)
+{
+    unsigned int i;
+    RCU_INIT_POINTER(channel->message, NULL);
+    for (i = 0; i < channel->queue_count; i++)
     {
-        return SUCCESS;
+        put_large_message(channel->queue[(channel->queue_head + i) % channel->queue_capacity].large);
     }
+    unbuffer_large_message(channel->buffers[0].large);
+    unbuffer_large_message(channel->buffers[1].large);
+    kvfree(channel->queue);
+    uncharge_bytes(channel->slot, channel->queue_capacity * sizeof(struct Queued_Message));
+    if (channel->ring != NULL)
+    {
+        vfree(channel->ring);
+        uncharge_bytes(channel->slot, PAGE_ALIGN(sizeof(struct msg_slot_ring)));
+    }
+    mutex_destroy(&channel->lock);
+    uncharge_channel(channel->slot);
+    wake_up_pollfree(&channel->readers);
+    wake_up_pollfree(&channel->writers);
+    call_rcu(&channel->rcu, free_channel_rcu);
+}
 
-    return append_slot_to_ll(minor, get_current_slot());
+static void free_channel_rcu(struct rcu_head *head)
+{
+    kmem_cache_free(channel_cache, container_of(head, struct Channel, rcu));
 }
 
-static int append_slot_to_ll(int minor, struct Slot *tail)
+// Must be called with slot->lock held.
+static int insert_channel_into_index(struct Slot *slot, unsigned int id, struct Channel **channel)
 {
-    void *new_slot_address = (struct Slot *)kmalloc(sizeof(struct Slot), GFP_KERNEL);
-    if (!new_slot_address)
+    int insert_err;
+    struct Channel *new_channel;
+    int charge_err = charge_channel(slot);
+    if (charge_err != SUCCESS)
     {
+        return charge_err;
+    }
+    new_channel = (struct Channel *)kmem_cache_alloc(channel_cache, GFP_KERNEL);
+    if (!new_channel)
+    {
+        uncharge_channel(slot);
         return -ENOMEM;
     }
-    set_current_slot(tail); // we should enter this function with tail already current, but just in case
-    set_next_slot(new_slot_address);
-    set_current_slot(new_slot_address);
-    set_current_slot_minor(minor);
-    set_channel_count(0);
-    set_next_slot(NULL);
-    set_slot_channel_ll_head(NULL);
-    set_current_channel(NULL);
+    // The channel is fully initialized before it becomes visible in the index
+    initialize_channel(new_channel, slot, id);
+    insert_err = index_channel(get_slot_channels(slot), new_channel, GFP_KERNEL_ACCOUNT);
+    if (insert_err != SUCCESS)
+    {
+        kmem_cache_free(channel_cache, new_channel);
+        uncharge_channel(slot);
+        return insert_err;
+    }
+    set_channel_count(slot, get_channel_count(slot) + 1);
+    *channel = new_channel;
     return SUCCESS;
 }
 
-//---------------------------------------------------------------
-static int device_release(struct inode *inode,
-                          struct file *file)
+// Takes over the caller's reference to channel and drops the one to the
+// channel the file was set to before.
+static void write_channel_to_file(struct file *file, struct Channel *channel)
 {
-    return SUCCESS;
+    WRITE_ONCE(get_file_context(file)->seen_version, 0);
+    WRITE_ONCE(get_file_context(file)->missed, 0);
+    put_channel(xchg(&get_file_context(file)->channel, channel));
 }
 
 //---------------------------------------------------------------
-static ssize_t device_read(struct file *file,
-                           char __user *buffer,
-                           size_t length,
-                           loff_t *offset)
-{
-    int message_length;
-    char *message;
-    int validity = set_channel_and_check_read_validity(file, length);
-    if (validity != SUCCESS)
-    {
-        return validity;
-    }
+static const struct seq_operations snapshot_seq_ops = {
+    .start = snapshot_start,
+    .next = snapshot_next,
+    .stop = snapshot_stop,
+    .show = snapshot_show,
+};
 
-    message_length = get_current_message_length();
-    message = get_current_message();
+static const struct file_operations snapshot_fops = {
+    .owner = THIS_MODULE,
+    .open = snapshot_open,
+    .read = seq_read,
+    .write = snapshot_write,
+    .llseek = seq_lseek,
+    .release = snapshot_release,
+};
 
-    return read_buffer(buffer, length, message, message_length);
+static int snapshot_open(struct inode *inode, struct file *file)
+{
+    return __seq_open_private(file, &snapshot_seq_ops, sizeof(struct Snapshot)) != NULL ? SUCCESS : -ENOMEM;
 }
 
-static ssize_t read_buffer(char __user *buffer, size_t buffer_length, char *message, int message_length)
+static int snapshot_release(struct inode *inode, struct file *file)
 {
-    ssize_t num_bytes_read = 0;
-    char *backup_buffer = NULL;
-    int put_user_err;
-    int backup_err = back_up_user_buffer(buffer, buffer_length, backup_buffer);
-    if (backup_err != SUCCESS)
+    struct Snapshot *snapshot = ((struct seq_file *)file->private_data)->private;
+    if (snapshot->error == SUCCESS && (snapshot->step > RESTORE_CHANNEL || snapshot->received != 0))
     {
-        return backup_err;
+        printk(KERN_WARNING "message_slot: snapshot image ended mid-record, restored only up to there\n");
     }
-    for (; num_bytes_read < message_length; num_bytes_read++)
+    put_large_message(snapshot->large);
+    put_channel(snapshot->channel);
+    if (snapshot->slot != NULL)
     {
-        put_user_err = put_user(message[num_bytes_read], &buffer[num_bytes_read]);
-        if (put_user_err != SUCCESS)
-        {
-            restore_user_buffer_on_failure(buffer, buffer_length, backup_buffer);
-            return put_user_err;
-        }
+        release_slot(snapshot->slot);
     }
-    kfree(backup_buffer);
-    return num_bytes_read;
+    return seq_release_private(inode, file);
 }
 
-// Intended to ensure that read operations are atomic.
-static int back_up_user_buffer(char __user *buffer, size_t buffer_length, char *backup_buffer)
+// slots_lock is held from start to stop, which keeps every slot alive.
+// The position of a channel is only ever reached by stepping from the
+// previous one, so the cursor in the Snapshot names the channel at *pos.
+static void *snapshot_start(struct seq_file *file, loff_t *pos)
 {
-    backup_buffer = (char *)kmalloc(buffer_length, GFP_KERNEL);
-    if (!backup_buffer)
+    struct Snapshot *snapshot = file->private;
+    mutex_lock(&slots_lock);
+    if (*pos == 0)
     {
-        return -ENOMEM;
+        snapshot->minor = 0;
+        snapshot->channel_id = 0;
+        return SEQ_START_TOKEN;
     }
-    if (!buffer)
+    return find_snapshot_channel(snapshot);
+}
+
+static void *snapshot_next(struct seq_file *file, void *v, loff_t *pos)
+{
+    struct Snapshot *snapshot = file->private;
+    ++*pos;
+    if (v != SEQ_START_TOKEN)
     {
-        return -EINVAL;
+        put_channel(v);
+        snapshot->channel_id++;
     }
-
-    return -copy_from_user(backup_buffer, buffer, buffer_length); // 0 if successful, negative otherwise
+    return find_snapshot_channel(snapshot);
 }
 
-static int restore_user_buffer_on_failure(char __user *buffer, size_t buffer_length, char *backup_buffer)
+static void snapshot_stop(struct seq_file *file, void *v)
 {
-    int copy_err = copy_to_user(buffer, backup_buffer, buffer_length);
-    kfree(backup_buffer);
-    return copy_err;
+    if (v != NULL && v != SEQ_START_TOKEN)
+    {
+        put_channel(v);
+    }
+    mutex_unlock(&slots_lock);
 }
 
-static int set_channel_and_check_read_validity(struct file *file, int buffer_length)
+static int snapshot_show(struct seq_file *file, void *v)
 {
-    int message_length;
-    int valid_length;
-    int channel_set = set_channel_from_file(file);
-    if (channel_set != SUCCESS)
+    struct msg_slot_snapshot_header header = {MSG_SLOT_SNAPSHOT_MAGIC, MSG_SLOT_SNAPSHOT_VERSION};
+    struct msg_slot_snapshot_channel record;
+    struct Channel *channel = v;
+    struct Message *message;
+    struct Queued_Message *queued;
+    unsigned int i;
+    if (v == SEQ_START_TOKEN)
     {
-        return channel_set;
+        seq_write(file, &header, sizeof(header));
+        return SUCCESS;
     }
-
-    message_length = get_current_message_length();
-
-    valid_length = is_valid_read_length(message_length, buffer_length);
-    if (valid_length != SUCCESS)
+    mutex_lock(&channel->lock);
+    message = rcu_dereference_protected(channel->message, lockdep_is_held(&channel->lock));
+    record.minor = channel->slot->minor;
+    record.channel_id = channel->channel_id;
+    record.queue_capacity = channel->queue_capacity;
+    record.max_message_size = READ_ONCE(channel->max_message_size);
+    record.count = channel_in_queue_mode(channel) ? channel->queue_count : message != NULL;
+    record.flags = channel->broadcast ? MSG_SLOT_SNAPSHOT_BROADCAST : 0;
+    seq_write(file, &record, sizeof(record));
+    if (channel_in_queue_mode(channel))
+    {
+        for (i = 0; i < channel->queue_count; i++)
+        {
+            queued = &channel->queue[(channel->queue_head + i) % channel->queue_capacity];
+            show_snapshot_message(file, queued->large != NULL ? queued->large->data : queued->data, queued->length);
+        }
+    }
+    else if (message != NULL)
     {
-        return valid_length;
+        show_snapshot_message(file, get_message_data(message), message->length);
     }
+    mutex_unlock(&channel->lock);
     return SUCCESS;
 }
 
-static int is_valid_read_length(int message_length, int buffer_length)
+static void show_snapshot_message(struct seq_file *file, const char *data, __u32 length)
 {
-    if (message_length < 1)
+    seq_write(file, &length, sizeof(length));
+    seq_write(file, data, length);
+}
+
+// Must be called with slots_lock held.
+// Moves the cursor to the first channel at or after it and returns that
+// channel with a reference the caller must put, or NULL past the last one.
+static struct Channel *find_snapshot_channel(struct Snapshot *snapshot)
+{
+    struct Slot *slot;
+    struct Channel *channel;
+    while ((slot = xa_find(&slots, &snapshot->minor, ULONG_MAX, XA_PRESENT)) != NULL)
     {
-        return -EWOULDBLOCK;
+        rcu_read_lock();
+        while ((channel = xa_find(get_slot_channels(slot), &snapshot->channel_id, ULONG_MAX, XA_PRESENT)) != NULL)
+        {
+            if (refcount_inc_not_zero(&channel->refs))
+            {
+                rcu_read_unlock();
+                return channel;
+            }
+            snapshot->channel_id++;
+        }
+        rcu_read_unlock();
+        snapshot->minor++;
+        snapshot->channel_id = 0;
     }
-    return buffer_length < message_length ? -ENOSPC : SUCCESS;
+    return NULL;
 }
 
-//---------------------------------------------------------------
-static ssize_t device_write(struct file *file,
-                            const char __user *buffer,
-                            size_t length,
-                            loff_t *offset)
+// The image is parsed as it streams in, so it may be written in pieces of
+// any size. Channels restored before a failure stay restored.
+static ssize_t snapshot_write(struct file *file, const char __user *buffer, size_t length, loff_t *offset)
 {
+    struct Snapshot *snapshot = ((struct seq_file *)file->private_data)->private;
+    size_t done = 0;
+    ssize_t consumed;
+    while (snapshot->error == SUCCESS && done < length)
+    {
+        consumed = restore_bytes(snapshot, buffer + done, length - done);
+        if (consumed < 0)
+        {
+            snapshot->error = consumed;
+        }
+        else
+        {
+            done += consumed;
+        }
+    }
+    return snapshot->error != SUCCESS ? snapshot->error : length;
+}
 
-    int validity = set_channel_and_check_write_validity(file, length);
-    if (validity != SUCCESS)
+// Feeds the current step at most the bytes it is missing.
+// Returns the number of bytes consumed.
+static ssize_t restore_bytes(struct Snapshot *snapshot, const char __user *buffer, size_t length)
+{
+    size_t size;
+    char *destination = (char *)&snapshot->pending;
+    int step_err;
+    switch (snapshot->step)
     {
-        return validity;
+    case RESTORE_HEADER:
+        size = sizeof(snapshot->pending.header);
+        break;
+    case RESTORE_CHANNEL:
+        size = sizeof(snapshot->pending.channel);
+        break;
+    case RESTORE_LENGTH:
+        size = sizeof(snapshot->pending.length);
+        break;
+    default:
+        size = snapshot->length;
+        destination = snapshot->large != NULL ? snapshot->large->data : snapshot->data;
+        break;
+    }
+    length = min(length, size - snapshot->received);
+    if (copy_from_user(destination + snapshot->received, buffer, length) != 0)
+    {
+        return -EFAULT;
     }
+    snapshot->received += length;
+    if (snapshot->received == size)
+    {
+        snapshot->received = 0;
+        step_err = finish_restore_step(snapshot);
+        if (step_err != SUCCESS)
+        {
+            return step_err;
+        }
+    }
+    return length;
+}
 
-    return write_buffer(buffer, length);
+static int finish_restore_step(struct Snapshot *snapshot)
+{
+    switch (snapshot->step)
+    {
+    case RESTORE_HEADER:
+        if (snapshot->pending.header.magic != MSG_SLOT_SNAPSHOT_MAGIC ||
+            snapshot->pending.header.version != MSG_SLOT_SNAPSHOT_VERSION)
+        {
+            return -EINVAL;
+        }
+        snapshot->step = RESTORE_CHANNEL;
+        return SUCCESS;
+    case RESTORE_CHANNEL:
+        return restore_channel(snapshot);
+    case RESTORE_LENGTH:
+        return start_restoring_message(snapshot);
+    default:
+        return finish_restoring_message(snapshot);
+    }
 }
 
-static ssize_t write_buffer(const char __user *buffer, size_t length)
+// Creates the slot and channel of the record if need be and applies its
+// settings. The slot stays open for the records after it, which usually
+// share it.
+static int restore_channel(struct Snapshot *snapshot)
 {
-    char *previous_message = NULL;
-    int backup_err;
-    int backup_length;
-    int get_user_err;
-    char *message;
-    ssize_t num_bytes_written;
-    backup_length = get_current_message_length();
-    backup_err = back_up_current_message(previous_message);
-    if (!buffer)
+    struct msg_slot_snapshot_channel *record = &snapshot->pending.channel;
+    struct Channel *channel;
+    bool broadcast;
+    int restore_err;
+    if (record->minor > MINORMASK || is_valid_channel_id(record->channel_id) != SUCCESS ||
+        record->queue_capacity > MAX_QUEUE_CAPACITY || record->max_message_size > MAX_MESSAGE_SIZE ||
+        record->count > max(record->queue_capacity, 1U) ||
+        (record->flags & ~MSG_SLOT_SNAPSHOT_BROADCAST) != 0 ||
+        (record->flags == MSG_SLOT_SNAPSHOT_BROADCAST && record->queue_capacity == 0))
     {
         return -EINVAL;
     }
-    if (backup_err != SUCCESS)
+    put_channel(snapshot->channel);
+    snapshot->channel = NULL;
+    if (snapshot->slot != NULL && snapshot->slot->minor != record->minor)
     {
-        return backup_err;
+        release_slot(snapshot->slot);
+        snapshot->slot = NULL;
     }
-    reset_current_message();
-    allocate_current_message(length);
-    message = get_current_message();
-    if (message == NULL) // if kmalloc failed
+    if (snapshot->slot == NULL)
     {
-        return -ENOMEM;
+        restore_err = find_or_create_slot(record->minor, &snapshot->slot);
+        if (restore_err != SUCCESS)
+        {
+            snapshot->slot = NULL;
+            return restore_err;
+        }
+    }
+    restore_err = find_or_create_channel(snapshot->slot, record->channel_id, &channel);
+    if (restore_err != SUCCESS)
+    {
+        return restore_err;
     }
-    num_bytes_written = 0;
-    for (; num_bytes_written < length; num_bytes_written++)
+    snapshot->channel = channel;
+    WRITE_ONCE(channel->max_message_size, record->max_message_size);
+    broadcast = record->flags == MSG_SLOT_SNAPSHOT_BROADCAST;
+    if (record->queue_capacity != channel->queue_capacity || broadcast != channel_in_broadcast_mode(channel))
     {
-        get_user_err = get_user(message[num_bytes_written], &buffer[num_bytes_written]);
-        if (get_user_err != SUCCESS)
+        restore_err = change_queue_mode(channel, record->queue_capacity, broadcast);
+        if (restore_err != SUCCESS)
         {
-            restore_message_on_failure(previous_message, backup_length);
-            return get_user_err;
+            return restore_err;
         }
     }
-
-    set_current_message_length(num_bytes_written);
-    kfree(previous_message);
-    return num_bytes_written;
+    snapshot->messages_left = record->count;
+    snapshot->step = record->count > 0 ? RESTORE_LENGTH : RESTORE_CHANNEL;
+    return SUCCESS;
 }
 
-static int back_up_current_message(char *backup)
+static int start_restoring_message(struct Snapshot *snapshot)
 {
-    int i = 0;
-    char *message = get_current_message();
-    int message_length = get_current_message_length();
-    backup = (char *)kmalloc(message_length, GFP_KERNEL);
-    if (!backup)
+    int restore_err;
+    snapshot->length = snapshot->pending.length;
+    restore_err = is_valid_write_length(snapshot->channel, snapshot->length);
+    if (restore_err != SUCCESS)
     {
-        return -ENOMEM;
+        return restore_err;
     }
-    for (; i < message_length; i++)
+    if (snapshot->length > BUF_LEN)
     {
-        backup[i] = message[i];
+        restore_err = alloc_large_message(snapshot->slot, snapshot->length, &snapshot->large);
+        if (restore_err != SUCCESS)
+        {
+            snapshot->large = NULL;
+            return restore_err;
+        }
     }
+    snapshot->step = RESTORE_DATA;
     return SUCCESS;
 }
 
-// Intended to ensure that write operations are atomic.
-static void restore_message_on_failure(char *backup, int backup_length)
+// Stored like any write, so a queue-mode channel gets it appended and
+// readers, pollers and the mmap ring all see it.
+static int finish_restoring_message(struct Snapshot *snapshot)
 {
-    int i = 0;
-    reset_current_message();
-    allocate_current_message(backup_length);
-    set_current_message_length(backup_length);
-    for (; i < backup_length; i++)
+    struct Large_Message *large = snapshot->large;
+    ssize_t result;
+    snapshot->large = NULL;
+    result = store_message(snapshot->channel, large != NULL ? large->data : snapshot->data, snapshot->length, large, WAIT_FOR_LOCK);
+    if (result < 0)
     {
-        get_current_message()[i] = backup[i];
+        return result;
     }
-    kfree(backup);
+    snapshot->messages_left--;
+    snapshot->step = snapshot->messages_left > 0 ? RESTORE_LENGTH : RESTORE_CHANNEL;
+    return SUCCESS;
+}
+
+//---------------------------------------------------------------
+// Calls are only timed while stats are collected or their tracepoint is on;
+// otherwise this returns 0 and the call's duration reads as 0.
+static u64 start_timing(bool traced)
+{
+    return READ_ONCE(collect_stats) || traced ? ktime_get_ns() : 0;
+}
+
+static u64 elapsed_since(u64 start)
+{
+    return start != 0 ? ktime_get_ns() - start : 0;
+}
+
+static int finish_open(struct inode *inode, struct Slot *slot, u64 start, int result)
+{
+    u64 elapsed = elapsed_since(start);
+    record_call(slot, PATH_OPEN, elapsed, result);
+    trace_msg_slot_open(iminor(inode), result, elapsed);
+    return result;
 }
 
-static int set_channel_and_check_write_validity(struct file *file, size_t length)
+static ssize_t finish_transfer(struct file *file, enum Stat_Path path, unsigned int channel_id, size_t length, u64 start, ssize_t result)
 {
-    int channel_set;
-    int valid_length;
-    channel_set = set_channel_from_file(file);
-    if (channel_set != SUCCESS)
+    struct Slot *slot = get_file_context(file)->slot;
+    u64 elapsed = elapsed_since(start);
+    record_call(slot, path, elapsed, result);
+    if (path == PATH_READ)
     {
-        return channel_set;
+        trace_msg_slot_read(slot->minor, channel_id, length, result, elapsed);
     }
-
-    valid_length = is_valid_write_length(length);
-    if (valid_length != SUCCESS)
+    else
     {
-        return valid_length;
+        trace_msg_slot_write(slot->minor, channel_id, length, result, elapsed);
     }
-    return SUCCESS;
+    return result;
 }
 
-static int is_valid_write_length(int length)
+// slot may be NULL for calls that failed before finding their slot.
+static void record_call(struct Slot *slot, enum Stat_Path path, u64 elapsed, ssize_t result)
 {
-    return length > BUF_LEN || length < 1 ? -EMSGSIZE : SUCCESS;
+    if (!READ_ONCE(collect_stats))
+    {
+        return;
+    }
+    record_call_in(&global_stats, path, elapsed, result);
+    if (slot != NULL)
+    {
+        record_call_in(slot->stats, path, elapsed, result);
+    }
 }
 
-//----------------------------------------------------------------
-static long device_ioctl(struct file *file,
-                         unsigned int ioctl_command_id,
-                         unsigned long ioctl_param)
+static void record_call_in(struct Stats __percpu *stats, enum Stat_Path path, u64 elapsed, ssize_t result)
 {
-    int validity;
-    int channel_err;
-    validity = is_valid_ioctl_op(ioctl_command_id, ioctl_param);
-    if (validity != SUCCESS)
+    struct Path_Stats __percpu *path_stats = &stats->paths[path];
+    this_cpu_inc(path_stats->calls);
+    this_cpu_inc(path_stats->latency[min_t(unsigned int, fls64(elapsed), LATENCY_BUCKETS - 1)]);
+    if (result >= 0 && (path == PATH_READ || path == PATH_WRITE))
     {
-        return validity;
+        this_cpu_add(path_stats->bytes, result);
     }
-    channel_err = find_or_create_channel(ioctl_param);
-    if (channel_err != SUCCESS)
+    else if (result == -EWOULDBLOCK)
     {
-        return channel_err;
+        this_cpu_inc(path_stats->wouldblock);
+    }
+    else if (result == -ENOSPC)
+    {
+        this_cpu_inc(path_stats->nospc);
+    }
+    else if (result < 0)
+    {
+        this_cpu_inc(path_stats->errors);
     }
+}
 
-    // After the above, the current channel should be the one we want
-    write_channel_to_file(file, get_current_channel());
-    return SUCCESS;
+static struct Stats __percpu *get_stats(struct Slot *slot)
+{
+    return slot != NULL ? slot->stats : &global_stats;
 }
 
-static int is_valid_ioctl_op(unsigned int ioctl_command_id, unsigned int channel_id)
+// Failing to create debugfs entries is not an error; the module works
+// the same without them.
+static void create_debugfs(void)
 {
-    return ioctl_command_id == MSG_SLOT_CHANNEL && channel_id != 0 ? SUCCESS : -EINVAL;
+    debugfs_root = debugfs_create_dir(DEVICE_RANGE_NAME, NULL);
+    create_stats_files(debugfs_root, NULL);
+    debugfs_create_file("snapshot", 0600, debugfs_root, NULL, &snapshot_fops);
 }
 
-static int find_or_create_channel(unsigned int channel_id)
+static void create_slot_debugfs(struct Slot *slot)
 {
-    if (get_channel_count() == 0)
-    {
-        return initialize_slot_channel_ll(channel_id);
-    }
-    return find_or_append_channel_in_existing_ll(channel_id);
+    char name[12];
+    snprintf(name, sizeof(name), "%d", slot->minor);
+    slot->debugfs_dir = debugfs_create_dir(name, debugfs_root);
+    create_stats_files(slot->debugfs_dir, slot);
+}
+
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static const struct file_operations reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = reset_stats,
+};
+
+// slot is NULL for the global files in the debugfs root
+static void create_stats_files(struct dentry *dir, struct Slot *slot)
+{
+    debugfs_create_file("stats", 0444, dir, slot, &stats_fops);
+    debugfs_create_file("reset", 0200, dir, slot, &reset_fops);
 }
 
-static int initialize_slot_channel_ll(unsigned int id)
+static int stats_show(struct seq_file *file, void *unused)
 {
-    void *new_channel_address = (struct Channel *)kmalloc(sizeof(struct Channel), GFP_KERNEL);
-    if (!new_channel_address)
+    struct Slot *slot = file->private;
+    enum Stat_Path path;
+    if (slot != NULL)
     {
-        return -ENOMEM;
+        seq_printf(file, "channels %u\nbytes %ld\n", READ_ONCE(slot->channel_count), atomic_long_read(&slot->bytes));
+    }
+    else
+    {
+        seq_printf(file, "channels %d\nbytes %ld\n", atomic_read(&total_channels), atomic_long_read(&total_bytes));
+    }
+    for (path = 0; path < NR_PATHS; path++)
+    {
+        show_path_stats(file, get_stats(slot), path);
     }
-    set_slot_channel_ll_head(new_channel_address);
-    set_current_channel(get_slot_channel_ll_head());
-    initialize_current_channel(id);
     return SUCCESS;
 }
 
-static int find_or_append_channel_in_existing_ll(unsigned int channel_id)
+// One line per path: name, counters, then the latency histogram buckets.
+static void show_path_stats(struct seq_file *file, struct Stats __percpu *stats, enum Stat_Path path)
 {
-    struct Channel *channel = get_slot_channel_ll_head();
-    while (channel->next != NULL)
+    static const char *const names[NR_PATHS] = {"open", "ioctl", "read", "write"};
+    struct Path_Stats total = {0};
+    struct Path_Stats *cpu_stats;
+    int cpu;
+    int i;
+    for_each_possible_cpu(cpu)
     {
-        if (channel->channel_id == channel_id)
+        cpu_stats = &per_cpu_ptr(stats, cpu)->paths[path];
+        total.calls += cpu_stats->calls;
+        total.bytes += cpu_stats->bytes;
+        total.wouldblock += cpu_stats->wouldblock;
+        total.nospc += cpu_stats->nospc;
+        total.errors += cpu_stats->errors;
+        for (i = 0; i < LATENCY_BUCKETS; i++)
         {
-            set_current_channel(channel);
-            return SUCCESS;
+            total.latency[i] += cpu_stats->latency[i];
         }
-        channel = channel->next;
     }
-
-    set_current_channel(channel); // last channel in linked list
-    if (get_current_channel_id() == channel_id)
+    seq_printf(file, "%s calls %lu bytes %lu wouldblock %lu nospc %lu errors %lu latency_log2_ns",
+               names[path], total.calls, total.bytes, total.wouldblock, total.nospc, total.errors);
+    for (i = 0; i < LATENCY_BUCKETS; i++)
     {
-        return SUCCESS;
+        seq_printf(file, " %lu", total.latency[i]);
     }
-
-    return append_channel_to_ll(channel_id, get_current_channel());
+    seq_putc(file, '\n');
 }
 
-static int append_channel_to_ll(unsigned int id, struct Channel *tail)
+// Any write resets. Calls recorded concurrently may survive the reset.
+static ssize_t reset_stats(struct file *file, const char __user *buffer, size_t length, loff_t *offset)
 {
-    void *new_channel_address = (struct Channel *)kmalloc(sizeof(struct Channel), GFP_KERNEL);
-    if (!new_channel_address)
+    struct Stats __percpu *stats = get_stats(file->private_data);
+    int cpu;
+    for_each_possible_cpu(cpu)
     {
-        return -ENOMEM;
+        memset(per_cpu_ptr(stats, cpu), 0, sizeof(struct Stats));
     }
-    set_current_channel(tail);
-    set_next_channel(new_channel_address);
-    set_current_channel(new_channel_address);
-    set_next_channel(NULL);
-    initialize_current_channel(id);
-    return SUCCESS;
-}
-
-static void initialize_current_channel(unsigned int id)
-{
-    set_channel_count(get_channel_count() + 1);
-    set_current_channel_id(id);
-    set_current_message_length(0);
-    set_next_channel(NULL);
-}
-
-static void write_channel_to_file(struct file *file, struct Channel *channel)
-{
-    file->private_data = (void *)channel;
+    return length;
 }
 
 //==================== DEVICE SETUP =============================
@@ -505,84 +2861,115 @@ struct file_operations Fops = {
     .owner = THIS_MODULE,
     .read = device_read,
     .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
     .open = device_open,
     .unlocked_ioctl = device_ioctl,
+    .poll = device_poll,
+    .mmap = device_mmap,
+    .llseek = device_llseek,
     .release = device_release,
 };
 
 //---------------------------------------------------------------
 static int __init device_init(void)
 {
-    int slot_err;
     int rc = -1;
+    int cache_err = create_caches();
+    int shrinker_err;
+    if (cache_err != SUCCESS)
+    {
+        return cache_err;
+    }
+    shrinker_err = create_shrinker();
+    if (shrinker_err != SUCCESS)
+    {
+        destroy_caches();
+        return shrinker_err;
+    }
+
+    create_debugfs();
+
     rc = register_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME, &Fops);
 
     if (rc < 0)
     {
         printk(KERN_ERR "%s registration failed for  %d\n",
                DEVICE_FILE_NAME, MAJOR_NUM);
+        debugfs_remove(debugfs_root);
+        shrinker_free(message_shrinker);
+        destroy_caches();
         return rc;
     }
 
-    slot_err = initialize_slot_ll_head();
-    if (slot_err != SUCCESS)
-    {
-        return slot_err;
-    }
-
     printk("message_slot initialization was successful.");
 
     return SUCCESS;
 }
 
-static int initialize_slot_ll_head(void)
+static int create_caches(void)
 {
-    void *new_head_slot_address = (struct Slot *)kmalloc(sizeof(struct Slot), GFP_KERNEL);
-    if (!new_head_slot_address)
+    // SLAB_ACCOUNT charges every object to the memcg of the task creating it.
+    // The caches are named after the module and kept from being merged with
+    // others of the same size, so /proc/slabinfo shows their objects alone.
+    slot_cache = kmem_cache_create("message_slot_slot", sizeof(struct Slot), __alignof__(struct Slot),
+                                   SLAB_ACCOUNT | SLAB_NO_MERGE, NULL);
+    channel_cache = kmem_cache_create("message_slot_channel", sizeof(struct Channel), __alignof__(struct Channel),
+                                      SLAB_HWCACHE_ALIGN | SLAB_ACCOUNT | SLAB_NO_MERGE, NULL);
+    if (!slot_cache || !channel_cache)
     {
+        destroy_caches();
         return -ENOMEM;
     }
-    set_slot_ll_head(new_head_slot_address);
-    set_current_slot(new_head_slot_address);
-    set_next_slot(NULL);
-    set_slot_channel_ll_head(NULL);
-    set_current_channel(NULL);
-    set_channel_count(0);
-    set_current_slot_minor(UNDEFINED);
     return SUCCESS;
 }
 
+// kmem_cache_destroy() ignores NULL, so this also unwinds a partial create.
+static void destroy_caches(void)
+{
+    kmem_cache_destroy(channel_cache);
+    kmem_cache_destroy(slot_cache);
+}
+
 //---------------------------------------------------------------
 static void __exit device_cleanup(void)
 {
-    clean_up_slots();
     unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME);
+    debugfs_remove(debugfs_root);
+    shrinker_free(message_shrinker);
+    clean_up_slots();
+    rcu_barrier(); // wait for channels and slots freed through call_rcu()
+    destroy_caches();
 }
 
 static void clean_up_slots(void)
 {
-    struct Slot *next_slot;
-    set_current_slot(get_slot_ll_head());
-    while (get_current_slot() != NULL)
+    unsigned long minor;
+    struct Slot *slot;
+    unsigned int channels;
+    u64 start;
+    xa_for_each(&slots, minor, slot)
     {
-        next_slot = get_next_slot();
-        clean_up_channels();
-        kfree(get_current_slot());
-        set_current_slot(next_slot);
+        start = start_timing(trace_msg_slot_cleanup_enabled());
+        channels = get_channel_count(slot);
+        clean_up_channels(slot);
+        trace_msg_slot_cleanup(slot->minor, channels, elapsed_since(start));
+        free_percpu(slot->stats);
+        mutex_destroy(&slot->lock);
+        kmem_cache_free(slot_cache, slot);
     }
+    xa_destroy(&slots);
 }
 
-static void clean_up_channels(void)
+static void clean_up_channels(struct Slot *slot)
 {
-    struct Channel *next_channel;
-    set_current_channel(get_slot_channel_ll_head());
-    while (get_current_channel() != NULL)
-    {
-        next_channel = get_next_channel();
-        reset_current_message();
-        kfree(get_current_channel());
-        set_current_channel(next_channel);
+    unsigned long id;
+    struct Channel *channel;
+    xa_for_each(get_slot_channels(slot), id, channel)
+    { // with no file open, the index holds the only reference
+        destroy_channel(channel);
     }
+    xa_destroy(get_slot_channels(slot));
 }
 
 //---------------------------------------------------------------
@@ -590,185 +2977,119 @@ static void clean_up_channels(void)
 module_init(device_init);
 module_exit(device_cleanup);
 
+static const struct kernel_param_ops percpu_counter_ops = {
+    .get = get_percpu_counter,
+};
+module_param_cb(avoided_allocations, &percpu_counter_ops, &avoided_allocations, 0444);
+MODULE_PARM_DESC(avoided_allocations, "Writes that reused a channel buffer instead of allocating");
+module_param_cb(evicted_messages, &percpu_counter_ops, &evicted_messages, 0444);
+MODULE_PARM_DESC(evicted_messages, "Large messages dropped under memory pressure");
+module_param_cb(evicted_bytes, &percpu_counter_ops, &evicted_bytes, 0444);
+MODULE_PARM_DESC(evicted_bytes, "Bytes of large messages dropped under memory pressure");
+
+static const struct kernel_param_ops max_message_size_ops = {
+    .set = set_max_message_size,
+    .get = param_get_uint,
+};
+module_param_cb(max_message_size, &max_message_size_ops, &max_message_size, 0644);
+MODULE_PARM_DESC(max_message_size, "Longest message a channel accepts by default, up to MAX_MESSAGE_SIZE");
+
 //================== FUNCTIONS FOR STRUCTS ===========================
 
-// Returns SUCCESS if set successfully or -EINVAL if invalid
-static int set_channel_from_file(struct file *file)
+// kp->arg is the per-CPU counter to sum
+static int get_percpu_counter(char *buffer, const struct kernel_param *kp)
 {
-    int minor = iminor(file_inode(file));
-    int id;
-    struct Channel *channel;
-    if (file->private_data == NULL)
-    { // if read/write attempted before ioctl invoked
-        return -EINVAL;
+    int cpu;
+    unsigned long total = 0;
+    for_each_possible_cpu(cpu)
+    {
+        total += *per_cpu_ptr((unsigned long __percpu *)kp->arg, cpu);
     }
-    channel = (struct Channel *)file->private_data;
-    id = get_channel_id(channel);
-    return set_state(minor, id);
+    return sprintf(buffer, "%lu\n", total);
 }
 
-static int set_state(int minor, int id)
+// Returns SUCCESS if set successfully or -EINVAL if invalid
+static int set_max_message_size(const char *value, const struct kernel_param *kp)
 {
-    int slot_err = search_and_set_slot_by_minor(minor);
-    int channel_err = search_and_set_channel_by_id(id);
-
-    return slot_err == SUCCESS && channel_err == SUCCESS ? SUCCESS : -EINVAL;
+    return param_set_uint_minmax(value, kp, 1, MAX_MESSAGE_SIZE);
 }
 
-static int search_and_set_slot_by_minor(int minor)
+// Returns the file's channel with a reference the caller must put.
+// Retries if another thread sets the file to a new channel meanwhile and
+// the old one is being freed.
+static int get_channel_from_file(struct file *file, struct Channel **channel)
 {
-    struct Slot *slot = get_slot_ll_head();
-    // Standard linked list traversal search
-    while (slot != NULL)
+    struct File_Context *context = get_file_context(file);
+    rcu_read_lock();
+    do
     {
-        if (slot->minor == minor)
-        {
-            set_current_slot(slot);
-            return SUCCESS;
-        }
-        slot = slot->next_slot;
+        *channel = READ_ONCE(context->channel);
+    } while (*channel != NULL && !refcount_inc_not_zero(&(*channel)->refs));
+    rcu_read_unlock();
+    if (*channel == NULL)
+    { // if read/write attempted before ioctl invoked
+        return -EINVAL;
     }
-    return -1;
-}
-
-static int search_and_set_channel_by_id(int id)
-{
-    struct Channel *channel = get_slot_channel_ll_head();
-    while (channel != NULL)
+    if (channel_deleted(*channel))
     {
-        if (channel->channel_id == id)
-        {
-            set_current_channel(channel);
-            return SUCCESS;
-        }
-        channel = channel->next;
+        put_channel(*channel);
+        return -EIDRM;
     }
-    return -1;
+    return SUCCESS;
 }
 
 //================== GETTERS & SETTERS ===========================
 
-static struct Slot *get_current_slot(void)
-{
-    return current_slot;
-}
-
-static void set_current_slot(struct Slot *slot)
-{
-    current_slot = slot;
-}
-
-static struct Slot *get_slot_ll_head(void)
-{
-    return slot_linked_list_head;
-}
-
-static void set_slot_ll_head(struct Slot *slot)
-{
-    slot_linked_list_head = slot;
-}
-
-static int get_current_slot_minor(void)
-{
-    return get_current_slot()->minor;
-}
-
-static void set_current_slot_minor(int minor)
-{
-    get_current_slot()->minor = minor;
-}
-
-static struct Slot *get_next_slot(void)
-{
-    return get_current_slot()->next_slot;
-}
-
-static void set_next_slot(struct Slot *slot)
-{
-    get_current_slot()->next_slot = slot;
-}
-
-static struct Channel *get_current_channel(void)
-{
-    return get_current_slot()->current_channel;
-}
-
-static void set_current_channel(struct Channel *channel)
-{
-    get_current_slot()->current_channel = channel;
-}
-
-static u_int32_t get_channel_count(void)
-{
-    return get_current_slot()->channel_count;
-}
-
-static void set_channel_count(u_int32_t count)
-{
-    get_current_slot()->channel_count = count;
-}
-
-static struct Channel *get_slot_channel_ll_head(void)
-{
-    return get_current_slot()->channel_linked_list_head;
-}
-
-static void set_slot_channel_ll_head(struct Channel *channel)
-{
-    get_current_slot()->channel_linked_list_head = channel;
-}
-
-static char *get_current_message(void)
-{
-    return get_current_channel()->message;
-}
-
-static void allocate_current_message(size_t size)
+// In offset addressing mode the channel comes from the offset alone, so
+// threads sharing the file don't touch any per-file state. Reading a channel
+// that doesn't exist yet is the same as reading an empty one, so it is only
+// created when there is something to wait on.
+static int get_addressed_channel(struct file *file, loff_t offset, bool create, struct Channel **channel)
 {
-    struct Channel *current_channel = get_current_channel();
-    current_channel->message = (char *)kmalloc(size, GFP_KERNEL);
-}
-
-static void reset_current_message(void)
-{
-    char *current_message = get_current_message();
-    if (current_message != NULL)
+    struct File_Context *context = get_file_context(file);
+    int validity;
+    if (!READ_ONCE(context->offset_addressing))
     {
-        kfree(current_message);
+        return get_channel_from_file(file, channel);
     }
+    validity = offset < 0 ? -EINVAL : is_valid_channel_id(offset);
+    if (validity != SUCCESS)
+    {
+        return validity;
+    }
+    if (create)
+    {
+        return find_or_create_channel(context->slot, offset, channel);
+    }
+    return find_channel(context->slot, offset, channel);
 }
 
-static int get_current_message_length(void)
+static struct File_Context *get_file_context(struct file *file)
 {
-    return get_current_channel()->message_length;
+    return (struct File_Context *)file->private_data;
 }
 
-static void set_current_message_length(int length)
+static void set_slot_minor(struct Slot *slot, int minor)
 {
-    get_current_channel()->message_length = length;
+    slot->minor = minor;
 }
 
-static int get_current_channel_id(void)
+static u_int32_t get_channel_count(struct Slot *slot)
 {
-    return get_current_channel()->channel_id;
+    return slot->channel_count;
 }
 
-static int get_channel_id(struct Channel *channel)
+static void set_channel_count(struct Slot *slot, u_int32_t count)
 {
-    return channel->channel_id;
+    slot->channel_count = count;
 }
 
-static void set_current_channel_id(int id)
+static struct xarray *get_slot_channels(struct Slot *slot)
 {
-    get_current_channel()->channel_id = id;
+    return &slot->channels;
 }
 
-static struct Channel *get_next_channel(void)
+static void initialize_slot_channels(struct Slot *slot)
 {
-    return get_current_channel()->next;
+    xa_init(get_slot_channels(slot));
 }
-
-static void set_next_channel(struct Channel *next_channel)
-{
-    get_current_channel()->next = next_channel;
-}
\ No newline at end of file
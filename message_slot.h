@@ -1,8 +1,171 @@
+#ifndef MESSAGE_SLOT_H
+#define MESSAGE_SLOT_H
+
+#include <linux/types.h>
+
 #define MAJOR_NUM 235 // hardcoded as per specs
 #define MSG_SLOT_CHANNEL _IOW(MAJOR_NUM, 0, unsigned long)
+#define MSG_SLOT_QUEUE_MODE _IOW(MAJOR_NUM, 1, unsigned long) // param: queue capacity, 0 for overwrite mode
+#define MSG_SLOT_OFFSET_ADDRESSING _IOW(MAJOR_NUM, 4, unsigned long) // param: 1 to address channels by file offset (pread/pwrite, or lseek then read/write), 0 to stop
+#define MSG_SLOT_DELETE_CHANNEL _IOW(MAJOR_NUM, 6, unsigned long) // param: channel id
+#define MSG_SLOT_MAX_MESSAGE_SIZE _IOW(MAJOR_NUM, 5, unsigned long) // param: longest message the channel accepts, 0 for the module default
+#define MSG_SLOT_BROADCAST_MODE _IOW(MAJOR_NUM, 8, unsigned long) // param: history capacity, 0 for overwrite mode
+#define MAX_QUEUE_CAPACITY 1024
+#define MAX_MESSAGE_SIZE (8 << 20)
 #define DEVICE_RANGE_NAME "message_slot"
 #define BUF_LEN 128
 #define DEVICE_FILE_NAME "ms_dev"
 #define SUCCESS 0
 #define UNDEFINED -1
 #define EXIT_FAILURE 1
+
+/*
+    Read-only ring exposed by mmap() on a file bound to a channel. Every write
+    to the channel is also copied into entries[version % MSG_SLOT_RING_ENTRIES]
+    and then published in latest_version, so readers can follow the channel
+    without any syscall. To read version v (1 <= v <= latest_version):
+        seq = entry.seq (acquire); if seq != 2 * v, v was overwritten or is
+        being written; otherwise copy entry.length bytes of entry.data, then
+        (after a read barrier) check entry.seq is still 2 * v.
+    Messages longer than BUF_LEN are mirrored truncated; entry.message_length
+    holds their full length, to be read with read() if needed.
+*/
+#define MSG_SLOT_RING_ENTRIES 256
+
+struct msg_slot_ring_entry
+{
+    __u64 seq; // odd while being written, 2 * version once complete
+    __u32 length;         // of data, at most BUF_LEN
+    __u32 message_length; // of the whole message
+    char data[BUF_LEN];
+};
+
+struct msg_slot_ring
+{
+    __u64 latest_version; // 0 until the first write
+    __u32 capacity;       // MSG_SLOT_RING_ENTRIES
+    __u32 entry_size;     // sizeof(struct msg_slot_ring_entry)
+    __u64 reserved[6];
+    struct msg_slot_ring_entry entries[MSG_SLOT_RING_ENTRIES];
+};
+
+/*
+    Batch transfers: MSG_SLOT_BATCH_WRITE and MSG_SLOT_BATCH_READ take a
+    struct msg_slot_batch pointing at count entries. Each entry writes or
+    reads one message on channel_id in the slot of the file (whatever channel
+    the file itself is set to), and its result is set to what write() or
+    read() would have returned: the number of bytes or -errno. Batches never
+    block. The ioctl returns the number of entries that succeeded.
+    MAX_BATCH_ENTRIES is sized so that a fan-out updating one message on
+    each of several thousand channels per tick (the design load was about
+    5,000) fits in a single call with room to grow. At 24 bytes per entry
+    the largest batch is an array of 1.5 MiB.
+*/
+#define MAX_BATCH_ENTRIES 65536
+
+struct msg_slot_batch_entry
+{
+    __u32 channel_id;
+    __u32 length; // of the buffer
+    __u64 buffer; // user pointer
+    __s32 result; // set by the ioctl
+    __u32 reserved;
+};
+
+struct msg_slot_batch
+{
+    __u64 entries; // user pointer to count struct msg_slot_batch_entry
+    __u32 count;
+    __u32 reserved;
+};
+
+#define MSG_SLOT_BATCH_WRITE _IOW(MAJOR_NUM, 2, struct msg_slot_batch)
+#define MSG_SLOT_BATCH_READ _IOW(MAJOR_NUM, 3, struct msg_slot_batch)
+
+/*
+    Conditional read: MSG_SLOT_READ_IF_CHANGED takes a struct
+    msg_slot_conditional_read holding the version of the message the caller
+    last read from the file's channel (0 for none). If the channel still
+    holds that version it fails with -EAGAIN without copying anything;
+    otherwise it reads the current message into buffer as read() would and
+    sets version to the one read. Versions start at 1 and grow by one with
+    every write to the channel. Only channels in overwrite mode have a
+    current message, so queue mode fails with -EINVAL. Never blocks.
+*/
+struct msg_slot_conditional_read
+{
+    __u64 buffer;  // user pointer
+    __u32 length;  // of the buffer
+    __u32 reserved;
+    __u64 version; // in: last seen, out: of the message read
+};
+
+#define MSG_SLOT_READ_IF_CHANGED _IOWR(MAJOR_NUM, 7, struct msg_slot_conditional_read)
+
+/*
+    Broadcast mode: MSG_SLOT_BROADCAST_MODE switches the file's channel to
+    keep its last capacity messages (up to MAX_QUEUE_CAPACITY). Writes append
+    to that history, dropping the oldest message once it is full, and never
+    block. Each file set to the channel reads the history in order from its
+    own cursor, without consuming it for the others. A file starts at the
+    oldest message held when it first reads the channel; if the messages
+    after its cursor are dropped before it reads them, it skips to the
+    oldest one left and counts the ones it missed. MSG_SLOT_BROADCAST_READ
+    reads like read() and also reports the message's version and how many
+    messages the file missed since the last MSG_SLOT_BROADCAST_READ. Reads
+    that don't go through the file's own channel (offset addressing,
+    batches) have no cursor and get the oldest message held. Shrinking the
+    history drops its oldest messages; switching back to overwrite mode (0)
+    keeps the newest one as the channel's current message.
+*/
+struct msg_slot_broadcast_read
+{
+    __u64 buffer;  // user pointer
+    __u32 length;  // of the buffer
+    __u32 reserved;
+    __u64 version; // out: of the message read
+    __u64 missed;  // out: messages dropped before the file read them
+};
+
+#define MSG_SLOT_BROADCAST_READ _IOWR(MAJOR_NUM, 9, struct msg_slot_broadcast_read)
+
+/*
+    Binary records read by message_sender --stream --binary and written by
+    message_reader --stream --binary: this header, in host byte order,
+    followed by length bytes of payload.
+*/
+struct msg_slot_record
+{
+    __u32 channel_id;
+    __u32 length;
+};
+
+/*
+    Snapshot image of every slot, read from <debugfs>/message_slot/snapshot
+    and restored by writing it back to the same file: a struct
+    msg_slot_snapshot_header, then for each channel a struct
+    msg_slot_snapshot_channel followed by its count messages, each a __u32
+    length and that many bytes, oldest first. Fields are in host byte order
+    and nothing is padded.
+*/
+#define MSG_SLOT_SNAPSHOT_MAGIC 0x534c534d // "MSLS" in little-endian
+#define MSG_SLOT_SNAPSHOT_VERSION 2
+#define MSG_SLOT_SNAPSHOT_BROADCAST 1 // in msg_slot_snapshot_channel.flags
+
+struct msg_slot_snapshot_header
+{
+    __u32 magic;
+    __u32 version;
+};
+
+struct msg_slot_snapshot_channel
+{
+    __u32 minor;
+    __u32 channel_id;
+    __u32 queue_capacity;   // 0 in overwrite mode
+    __u32 max_message_size; // 0 for the module default
+    __u32 count;            // of messages: at most 1 in overwrite mode, else up to queue_capacity
+    __u32 flags;            // MSG_SLOT_SNAPSHOT_BROADCAST if the queue is a broadcast history
+};
+
+#endif // MESSAGE_SLOT_H
@@ -0,0 +1,150 @@
+#ifndef MESSAGE_SLOT_CORE_H
+#define MESSAGE_SLOT_CORE_H
+
+#include "message_slot_shim.h"
+#include "message_slot.h"
+
+/*
+    The channel index and message store of message_slot.c, which build both
+    in the module and, through message_slot_shim.h, in userspace. Everything
+    else about a channel (sleeping, queue mode, mmap rings, quotas, large
+    message refcounts) stays in message_slot.c, which only hands these
+    functions channels it allocated and payloads it already owns.
+    See the DATA STRUCTURES comment in message_slot.c for the design.
+*/
+
+struct Slot;
+struct Queued_Message;
+struct Large_Message;
+
+struct Message
+{
+    seqcount_t seq;
+    u64 version;
+    ssize_t length;
+    char data[BUF_LEN];
+    struct Large_Message *large; // holds the data instead if length > BUF_LEN
+};
+
+struct Channel
+{
+    unsigned int channel_id;
+    struct Slot *slot;
+    refcount_t refs; // one for the index, one per bound file, one per operation in flight
+    bool deleted;    // removed from the index; bound files get -EIDRM
+    struct rcu_head rcu;
+    struct Message __rcu *message; // NULL until the first write
+    struct mutex lock;
+    u64 version; // of the last publication, protected by lock
+    wait_queue_head_t readers;
+    wait_queue_head_t writers; // only used in queue mode
+    struct Message buffers[2];
+    // Queue mode state, protected by lock. queue_capacity is 0 in overwrite mode.
+    struct Queued_Message *queue;
+    unsigned int queue_capacity;
+    unsigned int queue_head;
+    unsigned int queue_count;
+    bool broadcast; // the queue is a history that reads don't consume and full writes trim
+    struct msg_slot_ring *ring; // NULL until the channel is first mapped, protected by lock
+    unsigned int max_message_size; // 0 to follow the max_message_size module parameter
+    bool referenced; // written or read since the shrinker last looked
+};
+
+static inline void set_channel_id(struct Channel *channel, unsigned int id)
+{
+    channel->channel_id = id;
+}
+
+// The channel starts with the index's reference.
+static inline void initialize_channel(struct Channel *channel, struct Slot *slot, unsigned int id)
+{
+    set_channel_id(channel, id);
+    channel->slot = slot;
+    refcount_set(&channel->refs, 1);
+    channel->deleted = false;
+    RCU_INIT_POINTER(channel->message, NULL);
+    mutex_init(&channel->lock);
+    channel->version = 0;
+    init_waitqueue_head(&channel->readers);
+    init_waitqueue_head(&channel->writers);
+    channel->queue = NULL;
+    channel->queue_capacity = 0;
+    channel->queue_head = 0;
+    channel->queue_count = 0;
+    channel->broadcast = false;
+    channel->ring = NULL;
+    channel->max_message_size = 0;
+    channel->referenced = false;
+    channel->buffers[0].large = NULL;
+    channel->buffers[1].large = NULL;
+    seqcount_init(&channel->buffers[0].seq);
+    seqcount_init(&channel->buffers[1].seq);
+}
+
+// Must be called with the index's writers serialized (Slot.lock in the
+// module). The channel must be fully initialized, since lockless lookups
+// may find it as soon as this returns.
+static inline int index_channel(struct xarray *channels, struct Channel *channel, gfp_t gfp)
+{
+    return xa_insert(channels, channel->channel_id, channel, gfp);
+}
+
+// Lockless lookup. Returns the channel with a reference the caller must
+// put, or NULL if it doesn't exist or is on its way to being freed.
+static inline struct Channel *lookup_channel(struct xarray *channels, unsigned int channel_id)
+{
+    struct Channel *channel;
+    rcu_read_lock();
+    channel = xa_load(channels, channel_id);
+    if (channel != NULL && !refcount_inc_not_zero(&channel->refs))
+    {
+        channel = NULL;
+    }
+    rcu_read_unlock();
+    return channel;
+}
+
+// Must be called with channel->lock held.
+static inline struct Message *get_unpublished_message(struct Channel *channel)
+{
+    struct Message *published = rcu_dereference_protected(channel->message, lockdep_is_held(&channel->lock));
+    return published == &channel->buffers[0] ? &channel->buffers[1] : &channel->buffers[0];
+}
+
+// Readers that still hold the buffer from an earlier publication see the
+// sequence change and retry. Preemption stays off so they never spin long.
+static inline void fill_message(struct Message *message, const char *data, size_t length, struct Large_Message *large, u64 version)
+{
+    preempt_disable();
+    write_seqcount_begin(&message->seq);
+    message->version = version;
+    message->length = length;
+    message->large = large;
+    if (large == NULL)
+    {
+        memcpy(message->data, data, length);
+    }
+    write_seqcount_end(&message->seq);
+    preempt_enable();
+}
+
+// Must be called with channel->lock held.
+// The previous buffer stays with the channel and is refilled by the next write.
+static inline void publish_message(struct Channel *channel, struct Message *message)
+{
+    rcu_assign_pointer(channel->message, message);
+}
+
+// Must be called with channel->lock held. Publishes data (or large, if not
+// NULL) as version channel->version + 1, without bumping channel->version.
+// Returns the payload the recycled buffer held before, for the caller to put.
+static inline struct Large_Message *replace_message(struct Channel *channel, const char *data, size_t length, struct Large_Message *large)
+{
+    struct Message *message = get_unpublished_message(channel);
+    struct Large_Message *retired = message->large;
+    fill_message(message, data, length, large, channel->version + 1);
+    publish_message(channel, message);
+    return retired;
+}
+
+#endif // MESSAGE_SLOT_CORE_H
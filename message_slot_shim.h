@@ -0,0 +1,303 @@
+#ifndef MESSAGE_SLOT_SHIM_H
+#define MESSAGE_SLOT_SHIM_H
+
+/*
+    The kernel primitives message_slot_core.h is written against. In the
+    module these are the real ones; built without __KERNEL__ they are
+    stand-ins good enough to run the core in a plain process, so the data
+    structures can be measured without root (see core_bench.c):
+    - xarray is a radix tree with the kernel's 64-way fan-out. Readers may
+      run concurrently with one writer, since nodes are published with
+      release stores and only freed by xa_destroy().
+    - RCU read sections are empty, and nothing is freed from under them
+      (call_rcu() is never used by the core).
+    - seqcount, refcount and the *_ONCE accessors map to C11 atomics, and a
+      mutex is a pthread mutex.
+*/
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/refcount.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/preempt.h>
+
+#else
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+typedef unsigned int gfp_t;
+
+#define GFP_KERNEL 0u
+#define GFP_KERNEL_ACCOUNT 0u
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, val) __atomic_store_n(&(x), (val), __ATOMIC_RELAXED)
+
+// RCU
+#define __rcu
+struct rcu_head
+{
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+#define rcu_read_lock() do { } while (0)
+#define rcu_read_unlock() do { } while (0)
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_access_pointer(p) __atomic_load_n(&(p), __ATOMIC_RELAXED)
+#define rcu_dereference_protected(p, held) __atomic_load_n(&(p), __ATOMIC_RELAXED)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELAXED)
+#define preempt_disable() do { } while (0)
+#define preempt_enable() do { } while (0)
+
+// seqcount
+typedef struct
+{
+    unsigned int sequence;
+} seqcount_t;
+
+static inline void seqcount_init(seqcount_t *s)
+{
+    s->sequence = 0;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_t *s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int read_seqcount_begin(const seqcount_t *s)
+{
+    unsigned int seq;
+    while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1)
+    {
+    }
+    return seq;
+}
+
+static inline int read_seqcount_retry(const seqcount_t *s, unsigned int seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+// refcount
+typedef struct
+{
+    unsigned int refs;
+} refcount_t;
+
+static inline void refcount_set(refcount_t *r, unsigned int n)
+{
+    __atomic_store_n(&r->refs, n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int refcount_read(const refcount_t *r)
+{
+    return __atomic_load_n(&r->refs, __ATOMIC_RELAXED);
+}
+
+static inline void refcount_inc(refcount_t *r)
+{
+    __atomic_fetch_add(&r->refs, 1, __ATOMIC_RELAXED);
+}
+
+static inline bool refcount_inc_not_zero(refcount_t *r)
+{
+    unsigned int old = __atomic_load_n(&r->refs, __ATOMIC_RELAXED);
+    do
+    {
+        if (old == 0)
+        {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&r->refs, &old, old + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+}
+
+static inline bool refcount_dec_and_test(refcount_t *r)
+{
+    return __atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+// mutex
+struct mutex
+{
+    pthread_mutex_t mutex;
+};
+#define mutex_init(m) pthread_mutex_init(&(m)->mutex, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(&(m)->mutex)
+#define mutex_lock(m) pthread_mutex_lock(&(m)->mutex)
+#define mutex_unlock(m) pthread_mutex_unlock(&(m)->mutex)
+#define lockdep_is_held(m) true
+
+// Nobody sleeps on a channel outside the kernel
+typedef struct
+{
+    int unused;
+} wait_queue_head_t;
+#define init_waitqueue_head(q) ((q)->unused = 0)
+
+// xarray
+#define XA_CHUNK_SHIFT 6
+#define XA_CHUNK_SIZE (1UL << XA_CHUNK_SHIFT)
+#define XA_CHUNK_MASK (XA_CHUNK_SIZE - 1)
+#define XA_FLAGS_ACCOUNT 0u
+#define xa_init_flags(xa, flags) xa_init(xa)
+
+struct xa_node
+{
+    unsigned int shift; // of the index bits this node decodes, 0 in leaves
+    void *slots[XA_CHUNK_SIZE]; // child nodes, or entries in leaves
+};
+
+struct xarray
+{
+    struct xa_node *head;
+};
+
+static inline void xa_init(struct xarray *xa)
+{
+    xa->head = NULL;
+}
+
+static inline bool xa_node_covers(const struct xa_node *node, unsigned long index)
+{
+    return node->shift + XA_CHUNK_SHIFT >= sizeof(long) * 8 || index >> (node->shift + XA_CHUNK_SHIFT) == 0;
+}
+
+static inline void *xa_load(struct xarray *xa, unsigned long index)
+{
+    struct xa_node *node = __atomic_load_n(&xa->head, __ATOMIC_ACQUIRE);
+    if (node == NULL || !xa_node_covers(node, index))
+    {
+        return NULL;
+    }
+    while (node != NULL && node->shift > 0)
+    {
+        node = __atomic_load_n(&node->slots[(index >> node->shift) & XA_CHUNK_MASK], __ATOMIC_ACQUIRE);
+    }
+    return node != NULL ? __atomic_load_n(&node->slots[index & XA_CHUNK_MASK], __ATOMIC_ACQUIRE) : NULL;
+}
+
+static inline struct xa_node *xa_alloc_node(unsigned int shift)
+{
+    struct xa_node *node = calloc(1, sizeof(struct xa_node));
+    if (node != NULL)
+    {
+        node->shift = shift;
+    }
+    return node;
+}
+
+// Grows the tree until its head covers index, then returns the slot for it.
+static inline void **xa_slot_for(struct xarray *xa, unsigned long index)
+{
+    struct xa_node *node;
+    void **slot;
+    if (xa->head == NULL && (xa->head = xa_alloc_node(0)) == NULL)
+    {
+        return NULL;
+    }
+    while (!xa_node_covers(xa->head, index))
+    {
+        node = xa_alloc_node(xa->head->shift + XA_CHUNK_SHIFT);
+        if (node == NULL)
+        {
+            return NULL;
+        }
+        node->slots[0] = xa->head;
+        __atomic_store_n(&xa->head, node, __ATOMIC_RELEASE);
+    }
+    for (node = xa->head; node->shift > 0; node = *slot)
+    {
+        slot = &node->slots[(index >> node->shift) & XA_CHUNK_MASK];
+        if (*slot == NULL)
+        {
+            struct xa_node *child = xa_alloc_node(node->shift - XA_CHUNK_SHIFT);
+            if (child == NULL)
+            {
+                return NULL;
+            }
+            __atomic_store_n(slot, child, __ATOMIC_RELEASE);
+        }
+    }
+    return &node->slots[index & XA_CHUNK_MASK];
+}
+
+static inline int xa_insert(struct xarray *xa, unsigned long index, void *entry, gfp_t gfp)
+{
+    void **slot = xa_slot_for(xa, index);
+    (void)gfp;
+    if (slot == NULL)
+    {
+        return -ENOMEM;
+    }
+    if (*slot != NULL)
+    {
+        return -EBUSY;
+    }
+    __atomic_store_n(slot, entry, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Empty nodes are kept until xa_destroy(), so lockless readers never see one freed.
+static inline void *xa_erase(struct xarray *xa, unsigned long index)
+{
+    void **slot;
+    void *entry = xa_load(xa, index);
+    if (entry != NULL)
+    {
+        slot = xa_slot_for(xa, index);
+        __atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+    }
+    return entry;
+}
+
+static inline void xa_free_node(struct xa_node *node)
+{
+    unsigned long i;
+    for (i = 0; node->shift > 0 && i < XA_CHUNK_SIZE; i++)
+    {
+        if (node->slots[i] != NULL)
+        {
+            xa_free_node(node->slots[i]);
+        }
+    }
+    free(node);
+}
+
+// Frees the nodes only; the entries are the caller's.
+static inline void xa_destroy(struct xarray *xa)
+{
+    if (xa->head != NULL)
+    {
+        xa_free_node(xa->head);
+    }
+    xa_init(xa);
+}
+
+#endif // __KERNEL__
+
+#endif // MESSAGE_SLOT_SHIM_H
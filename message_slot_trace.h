@@ -0,0 +1,94 @@
+// Tracepoints on the device's entry points, under events/message_slot/ in
+// tracefs. Every event carries the duration of the call in nanoseconds,
+// measured only while the event (or collect_stats) is enabled.
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM message_slot
+
+#if !defined(_MESSAGE_SLOT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MESSAGE_SLOT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(msg_slot_open,
+            TP_PROTO(int minor, int result, u64 duration),
+            TP_ARGS(minor, result, duration),
+            TP_STRUCT__entry(
+                __field(int, minor)
+                __field(int, result)
+                __field(u64, duration)),
+            TP_fast_assign(
+                __entry->minor = minor;
+                __entry->result = result;
+                __entry->duration = duration;),
+            TP_printk("minor=%d result=%d duration=%llu",
+                      __entry->minor, __entry->result, __entry->duration));
+
+TRACE_EVENT(msg_slot_set_channel,
+            TP_PROTO(int minor, unsigned long channel_id, long result, u64 duration),
+            TP_ARGS(minor, channel_id, result, duration),
+            TP_STRUCT__entry(
+                __field(int, minor)
+                __field(unsigned long, channel_id)
+                __field(long, result)
+                __field(u64, duration)),
+            TP_fast_assign(
+                __entry->minor = minor;
+                __entry->channel_id = channel_id;
+                __entry->result = result;
+                __entry->duration = duration;),
+            TP_printk("minor=%d channel=%lu result=%ld duration=%llu",
+                      __entry->minor, __entry->channel_id, __entry->result, __entry->duration));
+
+// channel_id is 0 if the call failed before finding its channel
+DECLARE_EVENT_CLASS(msg_slot_transfer,
+                    TP_PROTO(int minor, unsigned int channel_id, size_t length, ssize_t result, u64 duration),
+                    TP_ARGS(minor, channel_id, length, result, duration),
+                    TP_STRUCT__entry(
+                        __field(int, minor)
+                        __field(unsigned int, channel_id)
+                        __field(size_t, length)
+                        __field(ssize_t, result)
+                        __field(u64, duration)),
+                    TP_fast_assign(
+                        __entry->minor = minor;
+                        __entry->channel_id = channel_id;
+                        __entry->length = length;
+                        __entry->result = result;
+                        __entry->duration = duration;),
+                    TP_printk("minor=%d channel=%u length=%zu result=%zd duration=%llu",
+                              __entry->minor, __entry->channel_id, __entry->length,
+                              __entry->result, __entry->duration));
+
+DEFINE_EVENT(msg_slot_transfer, msg_slot_read,
+             TP_PROTO(int minor, unsigned int channel_id, size_t length, ssize_t result, u64 duration),
+             TP_ARGS(minor, channel_id, length, result, duration));
+
+DEFINE_EVENT(msg_slot_transfer, msg_slot_write,
+             TP_PROTO(int minor, unsigned int channel_id, size_t length, ssize_t result, u64 duration),
+             TP_ARGS(minor, channel_id, length, result, duration));
+
+// Idle channels of a slot freed when its last file closes, or all of them at
+// module unload; channels counts the channels freed
+TRACE_EVENT(msg_slot_cleanup,
+            TP_PROTO(int minor, unsigned int channels, u64 duration),
+            TP_ARGS(minor, channels, duration),
+            TP_STRUCT__entry(
+                __field(int, minor)
+                __field(unsigned int, channels)
+                __field(u64, duration)),
+            TP_fast_assign(
+                __entry->minor = minor;
+                __entry->channels = channels;
+                __entry->duration = duration;),
+            TP_printk("minor=%d channels=%u duration=%llu",
+                      __entry->minor, __entry->channels, __entry->duration));
+
+#endif // _MESSAGE_SLOT_TRACE_H
+
+// The module is built out of tree, so define_trace.h is pointed back here
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE message_slot_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,99 @@
+#include "message_slot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h> /* open */
+#include <sys/ioctl.h>  /* ioctl */
+#include <unistd.h> /* read, write */
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Syscall latency benchmark for a single channel: times write() and read()
+ * of whole messages of several sizes and prints mean/p50/p99 in ns per call.
+ * Run it against two module builds to compare them.
+ * Usage: ./syscall_bench <device file> [iterations]
+ */
+
+#define DEFAULT_ITERATIONS 200000
+#define BENCH_CHANNEL 1
+
+static const int message_sizes[] = {1, 16, 64, BUF_LEN};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_long_long(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *op, int size, long long *samples, int iterations) {
+    long long total = 0;
+    for (int i = 0; i < iterations; i++) {
+        total += samples[i];
+    }
+    qsort(samples, iterations, sizeof(long long), compare_long_long);
+    printf("%-5s size %4d: mean %7lld ns, p50 %7lld ns, p99 %7lld ns\n", op, size,
+           total / iterations, samples[iterations / 2], samples[(int) (iterations * 0.99)]);
+}
+
+static int bench_size(int fd, int size, int iterations, long long *samples) {
+    char bffr[BUF_LEN];
+    long long start;
+    memset(bffr, 'm', sizeof(bffr));
+    for (int i = 0; i < iterations; i++) {
+        start = now_ns();
+        if (write(fd, bffr, size) != size) {
+            fprintf(stderr, "bench_size: write failed with error: %d\n", errno);
+            return -1;
+        }
+        samples[i] = now_ns() - start;
+    }
+    report("write", size, samples, iterations);
+    for (int i = 0; i < iterations; i++) {
+        start = now_ns();
+        if (read(fd, bffr, BUF_LEN) != size) {
+            fprintf(stderr, "bench_size: read failed with error: %d\n", errno);
+            return -1;
+        }
+        samples[i] = now_ns() - start;
+    }
+    report("read", size, samples, iterations);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = DEFAULT_ITERATIONS;
+    long long *samples;
+    int fd;
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <device file> [iterations]\n", argv[0]);
+        return -1;
+    }
+    if (argc > 2) {
+        iterations = atoi(argv[2]);
+    }
+    fd = open(argv[1], O_RDWR); /* argv[1] is a device created beforehand */
+    if (fd < 0) {
+        fprintf(stderr, "Can't open device file: %s\n", argv[1]);
+        return -1;
+    }
+    if (ioctl(fd, MSG_SLOT_CHANNEL, BENCH_CHANNEL) == -1) {
+        fprintf(stderr, "ioctl failed with error: %d\n", errno);
+        close(fd);
+        return -1;
+    }
+    samples = malloc(sizeof(long long) * iterations);
+    for (size_t i = 0; i < sizeof(message_sizes) / sizeof(message_sizes[0]); i++) {
+        if (bench_size(fd, message_sizes[i], iterations, samples) != 0) {
+            break;
+        }
+    }
+    free(samples);
+    close(fd);
+    return 0;
+}
@@ -1,13 +1,20 @@
+#define _GNU_SOURCE /* preadv2, RWF_NOWAIT */
 #include "message_slot.h" /* replace it with your own header if needed */
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h> /* minor */
 #include <fcntl.h> /* open */
 #include <sys/ioctl.h>  /* ioctl */
+#include <sys/mman.h>  /* mmap */
+#include <sys/uio.h>  /* readv, writev */
+#include <poll.h>
 #include <unistd.h> /* read, write */
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include "math.h"
 
 #define BUFF_SIZE 128
@@ -185,6 +192,912 @@ void write_read_before_ioctl(int fd) {
     }
 }
 
+/* fills a queue-mode channel, then drains it in write order */
+void queue_mode_order(int fd) {
+	printf("\n----- queue_mode_order ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char bffr[BUFF_SIZE];
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 30);
+	if (rc == -1) {
+        fprintf(stderr, "queue_mode_order: ioctl failed with error: %d\n", errno);
+		return;
+	}
+	rc = ioctl(fd, MSG_SLOT_QUEUE_MODE, 2);
+	if (rc == -1) {
+        fprintf(stderr, "queue_mode_order: queue ioctl failed with error: %d\n", errno);
+		return;
+	}
+	if (write(fd, "first", 5) != 5 || write(fd, "second", 6) != 6) {
+        passed=0;
+        fprintf(stderr, "queue_mode_order: write failed with error: %d\n", errno);
+	}
+	rc = write(fd, "third", 5);
+	if (rc != -1 || errno != EWOULDBLOCK) {
+        passed=0;
+        fprintf(stderr, "queue_mode_order: write to a full queue should fail with EWOULDBLOCK (11)\n");
+	}
+	rc = read(fd, bffr, BUFF_SIZE);
+	if (rc != 5 || strncmp(bffr, "first", 5) != 0) {
+        passed=0;
+        fprintf(stderr, "queue_mode_order: first read should return the oldest message\n");
+	}
+	rc = read(fd, bffr, BUFF_SIZE);
+	if (rc != 6 || strncmp(bffr, "second", 6) != 0) {
+        passed=0;
+        fprintf(stderr, "queue_mode_order: second read should return the newer message\n");
+	}
+	rc = read(fd, bffr, BUFF_SIZE);
+	if (rc != -1 || errno != EWOULDBLOCK) {
+        passed=0;
+        fprintf(stderr, "queue_mode_order: read of a drained queue should fail with EWOULDBLOCK (11)\n");
+	}
+	rc = ioctl(fd, MSG_SLOT_QUEUE_MODE, 0);
+	if (rc == -1) {
+        passed=0;
+        fprintf(stderr, "queue_mode_order: switching back to overwrite mode failed with error: %d\n", errno);
+	}
+    if(passed){
+        fprintf(stderr,"queue_mode_order: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"queue_mode_order: FAILED!\n");
+    }
+}
+
+/* reads a channel from another thread while it keeps switching to queue mode and back */
+#define SWITCH_ROUNDS 10000
+#define SWITCH_LENGTH 100
+volatile int switching_done;
+int switching_reader_failed;
+
+void *read_while_switching(void *arg) {
+	int fd = *(int *)arg;
+	char bffr[BUFF_SIZE];
+	while (!switching_done) {
+		int rc = read(fd, bffr, BUFF_SIZE);
+		if (rc == -1) {
+			continue;
+		}
+		/* every message is SWITCH_LENGTH copies of one letter, so a torn read shows */
+		for (int i = 0; i < rc; i++) {
+			if (rc != SWITCH_LENGTH || bffr[i] != bffr[0]) {
+				fprintf(stderr, "queue_switch_race: read returned a torn message of length %d\n", rc);
+				switching_reader_failed = 1;
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+void queue_switch_race(int fd) {
+	printf("\n----- queue_switch_race ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char msg[SWITCH_LENGTH];
+	char bffr[BUFF_SIZE];
+	pthread_t reader;
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 32);
+	if (rc == -1) {
+        fprintf(stderr, "queue_switch_race: ioctl failed with error: %d\n", errno);
+		return;
+	}
+	switching_done = 0;
+	switching_reader_failed = 0;
+	pthread_create(&reader, NULL, read_while_switching, &fd);
+	for (int round = 0; round < SWITCH_ROUNDS && passed; round++) {
+		memset(msg, 'a' + round % 26, SWITCH_LENGTH);
+		if (write(fd, msg, SWITCH_LENGTH) != SWITCH_LENGTH || ioctl(fd, MSG_SLOT_QUEUE_MODE, 1) == -1) {
+            passed=0;
+            fprintf(stderr, "queue_switch_race: write or queue ioctl failed with error: %d\n", errno);
+			break;
+		}
+		while (read(fd, bffr, BUFF_SIZE) != -1) {
+			/* drain what the reader didn't dequeue, so overwrite mode can come back */
+		}
+		if (ioctl(fd, MSG_SLOT_QUEUE_MODE, 0) == -1) {
+            passed=0;
+            fprintf(stderr, "queue_switch_race: switching back to overwrite mode failed with error: %d\n", errno);
+		}
+	}
+	switching_done = 1;
+	pthread_join(reader, NULL);
+	if (switching_reader_failed) {
+        passed=0;
+	}
+    if(passed){
+        fprintf(stderr,"queue_switch_race: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"queue_switch_race: FAILED!\n");
+    }
+}
+
+/* blocking_io is a module parameter, so tests that need readers to sleep turn it on and back off */
+int set_blocking_io(int on) {
+	FILE *param = fopen("/sys/module/message_slot/parameters/blocking_io", "w");
+	if (param == NULL) {
+		return -1;
+	}
+	fprintf(param, "%d", on);
+	return fclose(param);
+}
+
+/* a read() run in its own thread, so the test can change the channel while it sleeps */
+struct blocked_read {
+	pthread_t thread;
+	int fd;
+	int rc;
+	int error;
+	char bffr[BUFF_SIZE];
+};
+
+void *run_blocked_read(void *arg) {
+	struct blocked_read *blocked = arg;
+	blocked->rc = read(blocked->fd, blocked->bffr, BUFF_SIZE);
+	blocked->error = errno;
+	return NULL;
+}
+
+int start_blocked_read(struct blocked_read *blocked, int fd) {
+	struct timespec settle = {0, 100 * 1000 * 1000};
+	blocked->fd = fd;
+	if (pthread_create(&blocked->thread, NULL, run_blocked_read, blocked) != 0) {
+		return -1;
+	}
+	nanosleep(&settle, NULL); /* long enough for the reader to go to sleep */
+	return 0;
+}
+
+/* returns 0 once the read returned, -1 (after cancelling it) if it still hadn't after 2 seconds */
+int finish_blocked_read(struct blocked_read *blocked) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 2;
+	if (pthread_timedjoin_np(blocked->thread, NULL, &deadline) != 0) {
+		pthread_cancel(blocked->thread);
+		pthread_join(blocked->thread, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+/* a reader asleep on an empty channel gets the message written after the channel switches modes */
+void blocked_reader_mode_switch(int fd) {
+	printf("\n----- blocked_reader_mode_switch ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	struct blocked_read blocked;
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 33);
+	if (rc == -1 || set_blocking_io(1) != 0) {
+        fprintf(stderr, "blocked_reader_mode_switch: ioctl or setting blocking_io failed with error: %d\n", errno);
+		return;
+	}
+	/* overwrite mode -> queue mode */
+	if (start_blocked_read(&blocked, fd) != 0 || ioctl(fd, MSG_SLOT_QUEUE_MODE, 2) == -1 || write(fd, "queued", 6) != 6) {
+        passed=0;
+        fprintf(stderr, "blocked_reader_mode_switch: switching to queue mode or writing failed with error: %d\n", errno);
+	}
+	if (finish_blocked_read(&blocked) != 0 || blocked.rc != 6 || strncmp(blocked.bffr, "queued", 6) != 0) {
+        passed=0;
+        fprintf(stderr, "blocked_reader_mode_switch: a reader asleep in overwrite mode missed the queued message\n");
+	}
+	/* queue mode -> overwrite mode */
+	if (start_blocked_read(&blocked, fd) != 0 || ioctl(fd, MSG_SLOT_QUEUE_MODE, 0) == -1 || write(fd, "current", 7) != 7) {
+        passed=0;
+        fprintf(stderr, "blocked_reader_mode_switch: switching to overwrite mode or writing failed with error: %d\n", errno);
+	}
+	if (finish_blocked_read(&blocked) != 0 || blocked.rc != 7 || strncmp(blocked.bffr, "current", 7) != 0) {
+        passed=0;
+        fprintf(stderr, "blocked_reader_mode_switch: a reader asleep in queue mode missed the current message\n");
+	}
+	set_blocking_io(0);
+    if(passed){
+        fprintf(stderr,"blocked_reader_mode_switch: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"blocked_reader_mode_switch: FAILED!\n");
+    }
+}
+
+/* returns the poll() events of fd, waiting up to timeout ms for one */
+int poll_events(int fd, int timeout) {
+	struct pollfd polled = {fd, POLLIN | POLLOUT, 0};
+	if (poll(&polled, 1, timeout) == -1) {
+		return -1;
+	}
+	return polled.revents;
+}
+
+void *write_after_settle(void *arg) {
+	struct timespec settle = {0, 100 * 1000 * 1000};
+	nanosleep(&settle, NULL); /* long enough for the poller to go to sleep */
+	write(*(int *) arg, "woken", 5);
+	return NULL;
+}
+
+/* a channel polls readable once per message written, and a poller or blocking_io reader asleep on it wakes for the next one */
+void poll_readiness(int fd) {
+	printf("\n----- poll_readiness ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char bffr[BUFF_SIZE];
+	pthread_t writer;
+	struct blocked_read blocked;
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 45);
+	if (rc == -1) {
+        fprintf(stderr, "poll_readiness: ioctl failed with error: %d\n", errno);
+		return;
+	}
+	if (poll_events(fd, 0) != POLLOUT) {
+        passed=0;
+        fprintf(stderr, "poll_readiness: an empty channel should only poll writable\n");
+	}
+	if (write(fd, "ready", 5) != 5 || poll_events(fd, 0) != (POLLIN | POLLOUT)) {
+        passed=0;
+        fprintf(stderr, "poll_readiness: a channel should poll readable after a write\n");
+	}
+	if (read(fd, bffr, BUFF_SIZE) != 5 || poll_events(fd, 0) != POLLOUT) {
+        passed=0;
+        fprintf(stderr, "poll_readiness: a channel should stop polling readable once its message was read\n");
+	}
+	if (write(fd, "again", 5) != 5 || poll_events(fd, 0) != (POLLIN | POLLOUT)) {
+        passed=0;
+        fprintf(stderr, "poll_readiness: a channel should poll readable again after a new write\n");
+	}
+	if (read(fd, bffr, BUFF_SIZE) != 5 || pthread_create(&writer, NULL, write_after_settle, &fd) != 0) {
+        fprintf(stderr, "poll_readiness: read or pthread_create failed with error: %d\n", errno);
+		return;
+	}
+	rc = poll_events(fd, 2000);
+	pthread_join(writer, NULL);
+	if (rc == -1 || !(rc & POLLIN)) {
+        passed=0;
+        fprintf(stderr, "poll_readiness: a poller asleep on the channel wasn't woken by a write\n");
+	}
+	rc = ioctl(fd, MSG_SLOT_CHANNEL, 46);
+	if (rc == -1 || set_blocking_io(1) != 0) {
+        fprintf(stderr, "poll_readiness: ioctl or setting blocking_io failed with error: %d\n", errno);
+		return;
+	}
+	if (start_blocked_read(&blocked, fd) != 0 || write(fd, "awake", 5) != 5) {
+        passed=0;
+        fprintf(stderr, "poll_readiness: starting the reader or writing failed with error: %d\n", errno);
+	}
+	if (finish_blocked_read(&blocked) != 0 || blocked.rc != 5 || strncmp(blocked.bffr, "awake", 5) != 0) {
+        passed=0;
+        fprintf(stderr, "poll_readiness: a blocking_io reader asleep on an empty channel wasn't woken by a write\n");
+	}
+	set_blocking_io(0);
+    if(passed){
+        fprintf(stderr,"poll_readiness: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"poll_readiness: FAILED!\n");
+    }
+}
+
+/* checks that writes to a mapped channel show up in its ring */
+void mmap_ring_mirror(int fd) {
+	printf("\n----- mmap_ring_mirror ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	struct msg_slot_ring *ring;
+	struct msg_slot_ring_entry *entry;
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 40);
+	if (rc == -1) {
+        fprintf(stderr, "mmap_ring_mirror: ioctl failed with error: %d\n", errno);
+		return;
+	}
+	if (write(fd, "ring", 4) != 4) {
+        fprintf(stderr, "mmap_ring_mirror: write failed with error: %d\n", errno);
+		return;
+	}
+	ring = mmap(NULL, sizeof(struct msg_slot_ring), PROT_READ, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+        fprintf(stderr, "mmap_ring_mirror: mmap failed with error: %d\n", errno);
+		return;
+	}
+	entry = &ring->entries[ring->latest_version % MSG_SLOT_RING_ENTRIES];
+	if (ring->latest_version == 0 || entry->seq != 2 * ring->latest_version ||
+	    entry->length != 4 || strncmp(entry->data, "ring", 4) != 0) {
+        passed=0;
+        fprintf(stderr, "mmap_ring_mirror: ring doesn't hold the message written before mmap\n");
+	}
+	if (write(fd, "again", 5) != 5) {
+        passed=0;
+        fprintf(stderr, "mmap_ring_mirror: write failed with error: %d\n", errno);
+	}
+	entry = &ring->entries[ring->latest_version % MSG_SLOT_RING_ENTRIES];
+	if (entry->length != 5 || strncmp(entry->data, "again", 5) != 0) {
+        passed=0;
+        fprintf(stderr, "mmap_ring_mirror: ring doesn't hold the message written after mmap\n");
+	}
+	if (mmap(NULL, sizeof(struct msg_slot_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) != MAP_FAILED) {
+        passed=0;
+        fprintf(stderr, "mmap_ring_mirror: writable mmap hasn't failed although it should have\n");
+	}
+	munmap(ring, sizeof(struct msg_slot_ring));
+    if(passed){
+        fprintf(stderr,"mmap_ring_mirror: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"mmap_ring_mirror: FAILED!\n");
+    }
+}
+
+/* writes and reads several channels with one batch ioctl each */
+void batch_round_trip(int fd) {
+	printf("\n----- batch_round_trip ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char *messages[3] = {"alpha", "beta", "gamma"};
+	char bffrs[3][BUFF_SIZE];
+	struct msg_slot_batch_entry entries[4];
+	struct msg_slot_batch batch = {(__u64)(uintptr_t)entries, 3, 0};
+	int i;
+	for (i = 0; i < 3; i++) {
+		entries[i] = (struct msg_slot_batch_entry){50 + i, strlen(messages[i]), (__u64)(uintptr_t)messages[i], 0, 0};
+	}
+	int rc = ioctl(fd, MSG_SLOT_BATCH_WRITE, &batch);
+	if (rc != 3) {
+        passed=0;
+        fprintf(stderr, "batch_round_trip: batch write returned %d instead of 3, error: %d\n", rc, errno);
+	}
+	for (i = 0; i < 3; i++) {
+		entries[i] = (struct msg_slot_batch_entry){50 + i, BUFF_SIZE, (__u64)(uintptr_t)bffrs[i], 0, 0};
+	}
+	entries[3] = (struct msg_slot_batch_entry){59, BUFF_SIZE, (__u64)(uintptr_t)bffrs[0], 0, 0};
+	batch.count = 4;
+	rc = ioctl(fd, MSG_SLOT_BATCH_READ, &batch);
+	if (rc != 3) {
+        passed=0;
+        fprintf(stderr, "batch_round_trip: batch read returned %d instead of 3, error: %d\n", rc, errno);
+	}
+	for (i = 0; i < 3; i++) {
+		if (entries[i].result != (int)strlen(messages[i]) || strncmp(bffrs[i], messages[i], entries[i].result) != 0) {
+            passed=0;
+            fprintf(stderr, "batch_round_trip: channel %d doesn't hold the message batch-written to it\n", 50 + i);
+		}
+	}
+	if (entries[3].result != -EWOULDBLOCK) {
+        passed=0;
+        fprintf(stderr, "batch_round_trip: reading an unwritten channel should fail with EWOULDBLOCK (11)\n");
+	}
+    if(passed){
+        fprintf(stderr,"batch_round_trip: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"batch_round_trip: FAILED!\n");
+    }
+}
+
+/* gathers a message from two iovecs and scatters it into two others */
+void vectored_io(int fd) {
+	printf("\n----- vectored_io ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char head[4], tail[BUFF_SIZE];
+	struct iovec out[2] = {{"vect", 4}, {"ored", 4}};
+	struct iovec in[2] = {{head, sizeof(head)}, {tail, sizeof(tail)}};
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 60);
+	if (rc == -1) {
+        fprintf(stderr, "vectored_io: ioctl failed with error: %d\n", errno);
+		return;
+	}
+	rc = writev(fd, out, 2);
+	if (rc != 8) {
+        passed=0;
+        fprintf(stderr, "vectored_io: writev returned %d instead of 8, error: %d\n", rc, errno);
+	}
+	rc = readv(fd, in, 2);
+	if (rc != 8 || strncmp(head, "vect", 4) != 0 || strncmp(tail, "ored", 4) != 0) {
+        passed=0;
+        fprintf(stderr, "vectored_io: readv doesn't return the message written by writev\n");
+	}
+    if(passed){
+        fprintf(stderr,"vectored_io: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"vectored_io: FAILED!\n");
+    }
+}
+
+/* reads with RWF_NOWAIT, which io_uring also relies on to complete reads inline */
+void nowait_read(int fd) {
+	printf("\n----- nowait_read ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char bffr[BUFF_SIZE];
+	struct iovec in = {bffr, sizeof(bffr)};
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 61);
+	if (rc == -1) {
+        fprintf(stderr, "nowait_read: ioctl failed with error: %d\n", errno);
+		return;
+	}
+	rc = preadv2(fd, &in, 1, -1, RWF_NOWAIT);
+	if (rc != -1 || errno != EWOULDBLOCK) {
+        passed=0;
+        fprintf(stderr, "nowait_read: reading an empty channel should fail with EWOULDBLOCK (11), got %d, error: %d\n", rc, errno);
+	}
+	if (write(fd, "nowait", 6) != 6) {
+        fprintf(stderr, "nowait_read: write failed with error: %d\n", errno);
+		return;
+	}
+	rc = preadv2(fd, &in, 1, -1, RWF_NOWAIT);
+	if (rc != 6 || strncmp(bffr, "nowait", 6) != 0) {
+        passed=0;
+        fprintf(stderr, "nowait_read: preadv2 returned %d instead of the message, error: %d\n", rc, errno);
+	}
+    if(passed){
+        fprintf(stderr,"nowait_read: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"nowait_read: FAILED!\n");
+    }
+}
+
+/* reaches channels through pwrite / pread offsets instead of ioctl */
+void offset_addressing(int fd) {
+	printf("\n----- offset_addressing ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char bffr[BUFF_SIZE];
+	int rc = ioctl(fd, MSG_SLOT_OFFSET_ADDRESSING, 1);
+	if (rc == -1) {
+        fprintf(stderr, "offset_addressing: ioctl failed with error: %d\n", errno);
+		return;
+	}
+	if (pwrite(fd, "seventy", 7, 70) != 7 || pwrite(fd, "one", 3, 71) != 3) {
+        passed=0;
+        fprintf(stderr, "offset_addressing: pwrite failed with error: %d\n", errno);
+	}
+	rc = pread(fd, bffr, BUFF_SIZE, 70);
+	if (rc != 7 || strncmp(bffr, "seventy", 7) != 0) {
+        passed=0;
+        fprintf(stderr, "offset_addressing: pread doesn't return the message of channel 70\n");
+	}
+	rc = pread(fd, bffr, BUFF_SIZE, 71);
+	if (rc != 3 || strncmp(bffr, "one", 3) != 0) {
+        passed=0;
+        fprintf(stderr, "offset_addressing: pread doesn't return the message of channel 71\n");
+	}
+	if (lseek(fd, 71, SEEK_SET) != 71 || (rc = read(fd, bffr, BUFF_SIZE)) != 3 || strncmp(bffr, "one", 3) != 0) {
+        passed=0;
+        fprintf(stderr, "offset_addressing: read after lseek doesn't return the message of channel 71\n");
+	}
+	lseek(fd, 0, SEEK_SET);
+	rc = pread(fd, bffr, BUFF_SIZE, 72);
+	if (rc != -1 || errno != EWOULDBLOCK) {
+        passed=0;
+        fprintf(stderr, "offset_addressing: pread of an unwritten channel should fail with EWOULDBLOCK (11)\n");
+	}
+	rc = pread(fd, bffr, BUFF_SIZE, 0);
+	if (rc != -1 || errno != EINVAL) {
+        passed=0;
+        fprintf(stderr, "offset_addressing: pread at offset 0 should fail with EINVAL (22)\n");
+	}
+	struct iovec out = {"nowait", 6};
+	rc = pwritev2(fd, &out, 1, 73, RWF_NOWAIT);
+	if (rc != -1 || errno != EAGAIN) {
+        passed=0;
+        fprintf(stderr, "offset_addressing: a nowait pwrite creating channel 73 should fail with EAGAIN (11), got %d\n", rc);
+	}
+	if (pwrite(fd, "seventy three", 13, 73) != 13 || pwritev2(fd, &out, 1, 73, RWF_NOWAIT) != 6) {
+        passed=0;
+        fprintf(stderr, "offset_addressing: a nowait pwrite to existing channel 73 failed with error: %d\n", errno);
+	}
+	rc = ioctl(fd, MSG_SLOT_OFFSET_ADDRESSING, 0);
+	if (rc == -1) {
+        passed=0;
+        fprintf(stderr, "offset_addressing: disabling failed with error: %d\n", errno);
+	}
+    if(passed){
+        fprintf(stderr,"offset_addressing: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"offset_addressing: FAILED!\n");
+    }
+}
+
+/* raises a channel's size limit and round-trips a message longer than BUF_LEN */
+void large_message(int fd) {
+	printf("\n----- large_message ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	int size = 64 * 1024;
+	char *out = malloc(size + 1);
+	char *in = malloc(size + 1);
+	int i;
+	for (i = 0; i < size + 1; i++) {
+		out[i] = 'a' + i % 26;
+	}
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 80);
+	if (rc == -1 || ioctl(fd, MSG_SLOT_MAX_MESSAGE_SIZE, size) == -1) {
+        fprintf(stderr, "large_message: ioctl failed with error: %d\n", errno);
+		free(out);
+		free(in);
+		return;
+	}
+	rc = write(fd, out, size);
+	if (rc != size) {
+        passed=0;
+        fprintf(stderr, "large_message: write returned %d instead of %d, error: %d\n", rc, size, errno);
+	}
+	rc = read(fd, in, BUFF_SIZE);
+	if (rc != -1 || errno != ENOSPC) {
+        passed=0;
+        fprintf(stderr, "large_message: read into a short buffer should fail with ENOSPC (28)\n");
+	}
+	rc = read(fd, in, size);
+	if (rc != size || memcmp(in, out, size) != 0) {
+        passed=0;
+        fprintf(stderr, "large_message: read doesn't return the large message\n");
+	}
+	rc = write(fd, out, size + 1);
+	if (rc != -1 || errno != EMSGSIZE) {
+        passed=0;
+        fprintf(stderr, "large_message: write over the channel's limit should fail with EMSGSIZE (90)\n");
+	}
+	free(out);
+	free(in);
+    if(passed){
+        fprintf(stderr,"large_message: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"large_message: FAILED!\n");
+    }
+}
+
+/* deletes a channel while the file is still set to it */
+void delete_channel(int fd) {
+	printf("\n----- delete_channel ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char bffr[BUFF_SIZE];
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 90);
+	if (rc == -1 || write(fd, "doomed", 6) != 6) {
+        fprintf(stderr, "delete_channel: ioctl or write failed with error: %d\n", errno);
+		return;
+	}
+	rc = ioctl(fd, MSG_SLOT_DELETE_CHANNEL, 90);
+	if (rc == -1) {
+        passed=0;
+        fprintf(stderr, "delete_channel: delete failed with error: %d\n", errno);
+	}
+	rc = read(fd, bffr, BUFF_SIZE);
+	if (rc != -1 || errno != EIDRM) {
+        passed=0;
+        fprintf(stderr, "delete_channel: read of a deleted channel should fail with EIDRM (43)\n");
+	}
+	rc = ioctl(fd, MSG_SLOT_DELETE_CHANNEL, 90);
+	if (rc != -1 || errno != ENOENT) {
+        passed=0;
+        fprintf(stderr, "delete_channel: deleting a deleted channel should fail with ENOENT (2)\n");
+	}
+	rc = ioctl(fd, MSG_SLOT_CHANNEL, 90);
+	if (rc == -1) {
+        passed=0;
+        fprintf(stderr, "delete_channel: recreating the channel failed with error: %d\n", errno);
+	}
+	rc = read(fd, bffr, BUFF_SIZE);
+	if (rc != -1 || errno != EWOULDBLOCK) {
+        passed=0;
+        fprintf(stderr, "delete_channel: a recreated channel should start out empty\n");
+	}
+    if(passed){
+        fprintf(stderr,"delete_channel: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"delete_channel: FAILED!\n");
+    }
+}
+
+/* reads a channel only when it changed since the version last read */
+void read_if_changed(int fd) {
+	printf("\n----- read_if_changed ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char bffr[BUFF_SIZE];
+	struct msg_slot_conditional_read request = {(__u64)(uintptr_t)bffr, BUFF_SIZE, 0, 0};
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 95);
+	if (rc == -1 || write(fd, "first", 5) != 5) {
+        fprintf(stderr, "read_if_changed: ioctl or write failed with error: %d\n", errno);
+		return;
+	}
+	rc = ioctl(fd, MSG_SLOT_READ_IF_CHANGED, &request);
+	if (rc != 5 || strncmp(bffr, "first", 5) != 0 || request.version == 0) {
+        passed=0;
+        fprintf(stderr, "read_if_changed: first read returned %d instead of the message, error: %d\n", rc, errno);
+	}
+	rc = ioctl(fd, MSG_SLOT_READ_IF_CHANGED, &request);
+	if (rc != -1 || errno != EAGAIN) {
+        passed=0;
+        fprintf(stderr, "read_if_changed: reading an unchanged channel should fail with EAGAIN (11)\n");
+	}
+	__u64 seen = request.version;
+	if (write(fd, "second", 6) != 6) {
+        fprintf(stderr, "read_if_changed: second write failed with error: %d\n", errno);
+		return;
+	}
+	rc = ioctl(fd, MSG_SLOT_READ_IF_CHANGED, &request);
+	if (rc != 6 || strncmp(bffr, "second", 6) != 0 || request.version != seen + 1) {
+        passed=0;
+        fprintf(stderr, "read_if_changed: read after a write returned %d, version %llu instead of %llu\n",
+                rc, (unsigned long long)request.version, (unsigned long long)seen + 1);
+	}
+    if(passed){
+        fprintf(stderr,"read_if_changed: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"read_if_changed: FAILED!\n");
+    }
+}
+
+/* a broadcast history keeps the last messages written, and a reader that falls behind learns how many it missed */
+void broadcast_history(int fd) {
+	printf("\n----- broadcast_history ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char bffr[BUFF_SIZE];
+	char *messages[6] = {"a", "b", "c", "d", "e", "f"};
+	char *expected[3] = {"b", "c", "e"};
+	__u64 expected_missed[3] = {0, 0, 1};
+	struct msg_slot_broadcast_read request = {(__u64)(uintptr_t)bffr, BUFF_SIZE, 0, 0, 0};
+	int i;
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 97);
+	if (rc == -1 || ioctl(fd, MSG_SLOT_BROADCAST_MODE, 2) == -1) {
+        fprintf(stderr, "broadcast_history: ioctl failed with error: %d\n", errno);
+		return;
+	}
+	for (i = 0; i < 6; i++) {
+		if (write(fd, messages[i], 1) != 1) {
+            passed=0;
+            fprintf(stderr, "broadcast_history: write %d failed with error: %d\n", i, errno);
+		}
+		if (i == 2) { /* the history now holds b and c */
+			for (int j = 0; j < 2; j++) {
+				rc = ioctl(fd, MSG_SLOT_BROADCAST_READ, &request);
+				if (rc != 1 || bffr[0] != expected[j][0] || request.missed != expected_missed[j]) {
+                    passed=0;
+                    fprintf(stderr, "broadcast_history: read %d returned %d, missed %llu\n", j, rc, (unsigned long long)request.missed);
+				}
+			}
+			if (read(fd, bffr, BUFF_SIZE) != -1 || errno != EWOULDBLOCK) {
+                passed=0;
+                fprintf(stderr, "broadcast_history: reading past the newest message should fail with EWOULDBLOCK (11)\n");
+			}
+		}
+	}
+	rc = ioctl(fd, MSG_SLOT_BROADCAST_READ, &request); /* d was dropped when f was written */
+	if (rc != 1 || bffr[0] != expected[2][0] || request.missed != expected_missed[2] || request.version != 5) {
+        passed=0;
+        fprintf(stderr, "broadcast_history: read after falling behind returned %d, missed %llu, version %llu\n",
+                rc, (unsigned long long)request.missed, (unsigned long long)request.version);
+	}
+    if(passed){
+        fprintf(stderr,"broadcast_history: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"broadcast_history: FAILED!\n");
+    }
+}
+
+/* switching into broadcast mode wakes queue readers without letting them consume the history,
+   and switching out keeps the newest message */
+void broadcast_mode_switch(int fd) {
+	printf("\n----- broadcast_mode_switch ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char bffr[BUFF_SIZE];
+	struct blocked_read blocked;
+	struct msg_slot_batch_entry entry = {98, BUFF_SIZE, (__u64)(uintptr_t)bffr, 0, 0};
+	struct msg_slot_batch batch = {(__u64)(uintptr_t)&entry, 1, 0};
+	int rc = ioctl(fd, MSG_SLOT_CHANNEL, 98);
+	if (rc == -1 || ioctl(fd, MSG_SLOT_QUEUE_MODE, 4) == -1 || set_blocking_io(1) != 0) {
+        fprintf(stderr, "broadcast_mode_switch: ioctl or setting blocking_io failed with error: %d\n", errno);
+		return;
+	}
+	if (start_blocked_read(&blocked, fd) != 0 || ioctl(fd, MSG_SLOT_BROADCAST_MODE, 4) == -1 || write(fd, "shared", 6) != 6) {
+        passed=0;
+        fprintf(stderr, "broadcast_mode_switch: switching to broadcast mode or writing failed with error: %d\n", errno);
+	}
+	if (finish_blocked_read(&blocked) != 0 || blocked.rc != 6 || strncmp(blocked.bffr, "shared", 6) != 0) {
+        passed=0;
+        fprintf(stderr, "broadcast_mode_switch: the reader asleep on the queue didn't get the broadcast message\n");
+	}
+	set_blocking_io(0);
+	rc = ioctl(fd, MSG_SLOT_BATCH_READ, &batch);
+	if (rc != 1 || entry.result != 6 || strncmp(bffr, "shared", 6) != 0) {
+        passed=0;
+        fprintf(stderr, "broadcast_mode_switch: the queue reader consumed the message from the history\n");
+	}
+	if (write(fd, "newer", 5) != 5 || write(fd, "newest", 6) != 6) {
+        passed=0;
+        fprintf(stderr, "broadcast_mode_switch: write failed with error: %d\n", errno);
+	}
+	rc = ioctl(fd, MSG_SLOT_BROADCAST_MODE, 0);
+	if (rc == -1) {
+        passed=0;
+        fprintf(stderr, "broadcast_mode_switch: leaving broadcast mode with a full history failed with error: %d\n", errno);
+	}
+	rc = read(fd, bffr, BUFF_SIZE);
+	if (rc != 6 || strncmp(bffr, "newest", 6) != 0) {
+        passed=0;
+        fprintf(stderr, "broadcast_mode_switch: overwrite mode should start with the newest message of the history\n");
+	}
+    if(passed){
+        fprintf(stderr,"broadcast_mode_switch: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"broadcast_mode_switch: FAILED!\n");
+    }
+}
+
+#define SNAPSHOT_FILE "/sys/kernel/debug/message_slot/snapshot"
+
+/* returns the whole snapshot image in a buffer the caller must free, NULL if it can't be read */
+char *dump_snapshot(size_t *size) {
+	size_t capacity = 4096;
+	char *image = malloc(capacity);
+	ssize_t rc;
+	int snapshot = open(SNAPSHOT_FILE, O_RDONLY);
+	*size = 0;
+	if (snapshot < 0) {
+		free(image);
+		return NULL;
+	}
+	while ((rc = read(snapshot, image + *size, capacity - *size)) > 0) {
+		*size += rc;
+		if (*size == capacity) {
+			capacity *= 2;
+			image = realloc(image, capacity);
+		}
+	}
+	close(snapshot);
+	if (rc < 0) {
+		free(image);
+		return NULL;
+	}
+	return image;
+}
+
+/* copies the header and the records of channels first to last of minor into filtered, returns the size copied */
+size_t filter_snapshot(char *image, size_t size, unsigned int minor, unsigned int first, unsigned int last, char *filtered) {
+	struct msg_slot_snapshot_channel record;
+	uint32_t length;
+	size_t at = sizeof(struct msg_slot_snapshot_header), kept = at, start;
+	memcpy(filtered, image, at);
+	while (at + sizeof(record) <= size) {
+		start = at;
+		memcpy(&record, image + at, sizeof(record));
+		at += sizeof(record);
+		for (uint32_t i = 0; i < record.count && at + sizeof(length) <= size; i++) {
+			memcpy(&length, image + at, sizeof(length));
+			at += sizeof(length) + length;
+		}
+		if (at > size) {
+			break;
+		}
+		if (record.minor == minor && record.channel_id >= first && record.channel_id <= last) {
+			memcpy(filtered + kept, image + start, at - start);
+			kept += at - start;
+		}
+	}
+	return kept;
+}
+
+/* writes image in two pieces that split a record, since the module parses it as it streams in; returns -1 with errno on failure */
+int restore_snapshot(void *image, size_t size) {
+	size_t split = size / 2 + 1;
+	int rc = 0;
+	int snapshot = open(SNAPSHOT_FILE, O_WRONLY);
+	if (snapshot < 0) {
+		return -1;
+	}
+	if (write(snapshot, image, split) != (ssize_t) split || write(snapshot, (char *) image + split, size - split) != (ssize_t) (size - split)) {
+		rc = -1;
+	}
+	close(snapshot);
+	return rc;
+}
+
+/* dumps overwrite, queue, broadcast and large channels, deletes them, restores them and dumps them again */
+void snapshot_round_trip(int fd) {
+	printf("\n----- snapshot_round_trip ---------- \n");
+	fflush(stdout);
+	int passed=1;
+	char large[1000];
+	char bffr[BUFF_SIZE];
+	struct stat device;
+	char *image, *before, *after;
+	size_t size, before_size, after_size = 0;
+	unsigned int channel;
+	memset(large, 'l', sizeof(large));
+	int rc = fstat(fd, &device);
+	if (rc == -1 ||
+		ioctl(fd, MSG_SLOT_CHANNEL, 40) == -1 || write(fd, "overwrite", 9) != 9 ||
+		ioctl(fd, MSG_SLOT_CHANNEL, 41) == -1 || ioctl(fd, MSG_SLOT_QUEUE_MODE, 4) == -1 ||
+		write(fd, "q1", 2) != 2 || write(fd, "q2", 2) != 2 ||
+		ioctl(fd, MSG_SLOT_CHANNEL, 42) == -1 || ioctl(fd, MSG_SLOT_BROADCAST_MODE, 4) == -1 ||
+		write(fd, "b1", 2) != 2 || write(fd, "b2", 2) != 2 ||
+		ioctl(fd, MSG_SLOT_CHANNEL, 43) == -1 || ioctl(fd, MSG_SLOT_MAX_MESSAGE_SIZE, sizeof(large)) == -1 ||
+		write(fd, large, sizeof(large)) != sizeof(large)) {
+        fprintf(stderr, "snapshot_round_trip: setting up the channels failed with error: %d\n", errno);
+		return;
+	}
+	image = dump_snapshot(&size);
+	if (image == NULL) {
+        fprintf(stderr, "snapshot_round_trip: can't read %s (is debugfs mounted?), error: %d\n", SNAPSHOT_FILE, errno);
+		return;
+	}
+	before = malloc(size);
+	before_size = filter_snapshot(image, size, minor(device.st_rdev), 40, 43, before);
+	free(image);
+	if (before_size < sizeof(struct msg_slot_snapshot_header) + 4 * sizeof(struct msg_slot_snapshot_channel)) {
+        passed=0;
+        fprintf(stderr, "snapshot_round_trip: the dump is missing some of channels 40 to 43\n");
+	}
+	for (channel = 40; channel <= 43; channel++) {
+		if (ioctl(fd, MSG_SLOT_DELETE_CHANNEL, channel) == -1) {
+            passed=0;
+            fprintf(stderr, "snapshot_round_trip: deleting channel %u failed with error: %d\n", channel, errno);
+		}
+	}
+	if (restore_snapshot(before, before_size) != 0) {
+        passed=0;
+        fprintf(stderr, "snapshot_round_trip: restoring failed with error: %d\n", errno);
+	}
+	image = dump_snapshot(&size);
+	after = malloc(image != NULL ? size : 1);
+	if (image != NULL) {
+		after_size = filter_snapshot(image, size, minor(device.st_rdev), 40, 43, after);
+		free(image);
+	}
+	if (after_size != before_size || memcmp(before, after, before_size) != 0) {
+        passed=0;
+        fprintf(stderr, "snapshot_round_trip: the restored channels differ from the dumped ones\n");
+	}
+	free(before);
+	free(after);
+	struct msg_slot_snapshot_header bad_magic = {~MSG_SLOT_SNAPSHOT_MAGIC, MSG_SLOT_SNAPSHOT_VERSION};
+	rc = restore_snapshot(&bad_magic, sizeof(bad_magic));
+	if (rc != -1 || errno != EINVAL) {
+        passed=0;
+        fprintf(stderr, "snapshot_round_trip: restoring an image with a bad magic should fail with EINVAL (22)\n");
+	}
+	/* a channel record promising a 5 byte message that ends after 2 of them */
+	struct {
+		struct msg_slot_snapshot_header header;
+		struct msg_slot_snapshot_channel record;
+		uint32_t length;
+		char data[2];
+	} __attribute__((packed)) truncated = {
+		{MSG_SLOT_SNAPSHOT_MAGIC, MSG_SLOT_SNAPSHOT_VERSION},
+		{minor(device.st_rdev), 44, 0, 0, 1, 0},
+		5,
+		{'t', 'r'},
+	};
+	rc = restore_snapshot(&truncated, sizeof(truncated));
+	if (rc == -1) {
+        passed=0;
+        fprintf(stderr, "snapshot_round_trip: restoring a truncated image failed with error: %d\n", errno);
+	}
+	rc = ioctl(fd, MSG_SLOT_CHANNEL, 44);
+	if (rc == -1 || read(fd, bffr, BUFF_SIZE) != -1 || errno != EWOULDBLOCK) {
+        passed=0;
+        fprintf(stderr, "snapshot_round_trip: the message cut short by a truncated image should not be stored\n");
+	}
+	ioctl(fd, MSG_SLOT_DELETE_CHANNEL, 44);
+    if(passed){
+        fprintf(stderr,"snapshot_round_trip: PASSED!\n");
+    }
+    else{
+        fprintf(stderr,"snapshot_round_trip: FAILED!\n");
+    }
+}
+
 int main(int argc, char *argv[]) {
 	int fd = open(argv[1], O_RDWR); /* argv[1] is a device created beforehand */
     srand(time(NULL));
@@ -197,6 +1110,21 @@ int main(int argc, char *argv[]) {
 	error_buffer_size(fd);
 	read_no_message(fd);
 	write_read_null(fd);
+	queue_mode_order(fd);
+	queue_switch_race(fd);
+	blocked_reader_mode_switch(fd);
+	poll_readiness(fd);
+	mmap_ring_mirror(fd);
+	batch_round_trip(fd);
+	vectored_io(fd);
+	nowait_read(fd);
+	offset_addressing(fd);
+	large_message(fd);
+	delete_channel(fd);
+	read_if_changed(fd);
+	broadcast_history(fd);
+	broadcast_mode_switch(fd);
+	snapshot_round_trip(fd);
 	close(fd);
 	return 0;
 }
@@ -0,0 +1,135 @@
+#include "message_slot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h> /* open */
+#include <sys/ioctl.h>  /* ioctl */
+#include <unistd.h> /* read, write */
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Multi-threaded stress test: every thread opens the device on its own,
+ * binds its own channel and loops write + read-back. Run with a growing
+ * number of threads; since different channels share no locks, ops/s should
+ * grow roughly linearly with the number of cores.
+ * Usage: ./tester3 <device file> [max threads] [iterations per thread]
+ */
+
+#define BUFF_SIZE 128
+#define DEFAULT_MAX_THREADS 8
+#define DEFAULT_ITERATIONS 100000
+
+const char *device_path;
+int iterations = DEFAULT_ITERATIONS;
+
+struct thread_args {
+    int channel;
+    unsigned int seed;
+    int passed; /* set by the thread, read once it is joined */
+};
+
+void fill_random_message(char *bffr, int length, unsigned int *seed) {
+    const char charset[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJK";
+    for (int i = 0; i < length; i++) {
+        bffr[i] = charset[rand_r(seed) % (int) (sizeof charset - 1)];
+    }
+}
+
+void *stress_channel(void *arg) {
+    struct thread_args *args = (struct thread_args *) arg;
+    char written[BUFF_SIZE];
+    char read_back[BUFF_SIZE];
+    int fd = open(device_path, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "stress_channel: can't open device file: %s\n", device_path);
+        args->passed = 0;
+        return NULL;
+    }
+    if (ioctl(fd, MSG_SLOT_CHANNEL, args->channel) == -1) {
+        fprintf(stderr, "stress_channel: ioctl failed with error: %d\n", errno);
+        args->passed = 0;
+        close(fd);
+        return NULL;
+    }
+    for (int i = 0; i < iterations; i++) {
+        int length = 1 + rand_r(&args->seed) % BUFF_SIZE;
+        fill_random_message(written, length, &args->seed);
+        if (write(fd, written, length) != length) {
+            fprintf(stderr, "stress_channel: write failed with error: %d\n", errno);
+            args->passed = 0;
+            break;
+        }
+        if (read(fd, read_back, BUFF_SIZE) != length || memcmp(written, read_back, length) != 0) {
+            fprintf(stderr, "stress_channel: channel %d read back a different message\n", args->channel);
+            args->passed = 0;
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+double elapsed_seconds(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* returns 1 if every thread passed */
+int run_with_threads(int num_threads) {
+    pthread_t threads[num_threads];
+    struct thread_args args[num_threads];
+    struct timespec start, end;
+    double seconds;
+    int started = 0;
+    int passed = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_threads; i++) {
+        args[i].channel = i + 1;
+        args[i].seed = (unsigned int) time(NULL) + i;
+        args[i].passed = 1;
+        if (pthread_create(&threads[i], NULL, stress_channel, &args[i]) != 0) {
+            fprintf(stderr, "run_with_threads: can't create thread %d\n", i);
+            passed = 0;
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        passed = passed && args[i].passed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = elapsed_seconds(&start, &end);
+    /* every iteration is one write and one read */
+    printf("threads: %2d, ops/s: %12.0f\n", num_threads, 2.0 * iterations * num_threads / seconds);
+    return passed;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = DEFAULT_MAX_THREADS;
+    int passed = 1;
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <device file> [max threads] [iterations per thread]\n", argv[0]);
+        return -1;
+    }
+    device_path = argv[1]; /* argv[1] is a device created beforehand */
+    if (argc > 2) {
+        max_threads = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        iterations = atoi(argv[3]);
+    }
+
+    printf("\n----- stress_channels ---------- \n");
+    for (int num_threads = 1; num_threads <= max_threads && passed; num_threads *= 2) {
+        passed = run_with_threads(num_threads);
+    }
+    if (passed) {
+        fprintf(stderr, "stress_channels: PASSED!\n");
+    }
+    else {
+        fprintf(stderr, "stress_channels: FAILED!\n");
+    }
+    return passed ? 0 : EXIT_FAILURE;
+}